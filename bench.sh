@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# Run the benchmark suite of generated traces through the simulator, and
+# report the operations per second of each phase:
+#
+#   compile : tracec turns the text trace into a binary trace
+#   text    : vm parses and simulates the text trace
+#   replay  : vm simulates the binary trace
+#   parse   : text - replay, the cost to parse the text trace
+#
+# Usage: bench.sh {vm binary}
+
+VM=${1:-./vm}
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+NR_OPS=1000000
+VM_OPTS="-q -t -m 4096 -l 3 -o summary"
+
+# name and tracegen options of each workload
+SUITE=(
+	"sequential	-d sequential -w 1024"
+	"uniform	-d uniform -w 1024"
+	"zipf		-d zipf -w 1024"
+	"strided	-d strided -w 1024 -k 16"
+	"fork		-d uniform -w 256 -r 0.5 -f 0.001 -p 16"
+	"switch		-d zipf -w 256 -f 0.0001 -s 0.01 -p 64"
+)
+
+now() {
+	date +%s.%N
+}
+
+# ops/s for @1 operations in @2 seconds
+rate() {
+	awk -v n="$1" -v t="$2" 'BEGIN { if (t > 0) printf "%12.0f", n / t; else printf "%12s", "-" }'
+}
+
+elapsed() {
+	awk -v s="$1" -v e="$2" 'BEGIN { printf "%.6f", e - s }'
+}
+
+printf "%-12s %12s %12s %12s %12s %12s\n" \
+	"workload" "ops" "compile/s" "text/s" "replay/s" "parse/s"
+
+for workload in "${SUITE[@]}"; do
+	name=$(echo "$workload" | cut -f1)
+	opts=$(echo "$workload" | cut -f2- | tr -s '\t' ' ')
+	text="$WORKDIR/$name"
+	bin="$WORKDIR/$name.bin"
+
+	./tracegen -n $NR_OPS -x 1 $opts > "$text" || exit 1
+
+	s=$(now); ./tracec "$text" "$bin" || exit 1; e=$(now)
+	t_compile=$(elapsed $s $e)
+
+	s=$(now); $VM $VM_OPTS "$text" > /dev/null 2>&1; e=$(now)
+	t_text=$(elapsed $s $e)
+
+	s=$(now); $VM $VM_OPTS "$bin" > /dev/null 2>&1; e=$(now)
+	t_replay=$(elapsed $s $e)
+
+	t_parse=$(elapsed $t_replay $t_text)
+
+	printf "%-12s %12u %s %s %s %s\n" "$name" $NR_OPS \
+		"$(rate $NR_OPS $t_compile)" "$(rate $NR_OPS $t_text)" \
+		"$(rate $NR_OPS $t_replay)" "$(rate $NR_OPS $t_parse)"
+done
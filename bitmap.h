@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BITMAP_H
+#define _BITMAP_H
+
+#include "types.h"
+
+/*
+ * Simple bitmap operations over arrays of unsigned long. The search
+ * functions scan a word at a time and use the bit scan builtins of the
+ * compiler to locate the bit within the word.
+ */
+
+#define BITS_PER_LONG		(sizeof(unsigned long) * 8)
+#define BITS_TO_LONGS(nr)	(((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+#define BIT_WORD(nr)		((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)		(1UL << ((nr) % BITS_PER_LONG))
+
+static inline void set_bit(unsigned int nr, unsigned long *map)
+{
+	map[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void clear_bit(unsigned int nr, unsigned long *map)
+{
+	map[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static inline bool test_bit(unsigned int nr, const unsigned long *map)
+{
+	return (map[BIT_WORD(nr)] & BIT_MASK(nr)) != 0;
+}
+
+/**
+ * __ffs - find the first set bit in a word
+ * @word: the word to search. Should not be zero.
+ */
+static inline unsigned int __ffs(unsigned long word)
+{
+	return __builtin_ctzl(word);
+}
+
+/**
+ * ffz - find the first zero bit in a word
+ * @word: the word to search. Should not be ~0UL.
+ */
+static inline unsigned int ffz(unsigned long word)
+{
+	return __builtin_ctzl(~word);
+}
+
+/**
+ * find_first_bit - find the first set bit in a bitmap
+ * @map:  the bitmap to search
+ * @size: the number of bits in the bitmap
+ *
+ * Returns the bit number of the first set bit, or @size if no bit is set.
+ */
+static inline unsigned int find_first_bit(const unsigned long *map,
+					  unsigned int size)
+{
+	for (unsigned int i = 0; i * BITS_PER_LONG < size; i++) {
+		if (map[i]) {
+			unsigned int nr = i * BITS_PER_LONG + __ffs(map[i]);
+			return nr < size ? nr : size;
+		}
+	}
+	return size;
+}
+
+/**
+ * find_first_zero_bit - find the first cleared bit in a bitmap
+ * @map:  the bitmap to search
+ * @size: the number of bits in the bitmap
+ *
+ * Returns the bit number of the first cleared bit, or @size if all bits
+ * are set.
+ */
+static inline unsigned int find_first_zero_bit(const unsigned long *map,
+					       unsigned int size)
+{
+	for (unsigned int i = 0; i * BITS_PER_LONG < size; i++) {
+		if (~map[i]) {
+			unsigned int nr = i * BITS_PER_LONG + ffz(map[i]);
+			return nr < size ? nr : size;
+		}
+	}
+	return size;
+}
+
+#endif
@@ -0,0 +1,197 @@
+/**********************************************************************
+ * Copyright (c) 2020-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "types.h"
+#include "bitmap.h"
+#include "buddy.h"
+
+static inline unsigned int __nr_blocks(struct buddy_zone *zone, unsigned int order)
+{
+	return zone->nr_frames >> order;
+}
+
+/**
+ * Mark the page frames [@r, @r + @nr) in use. @r is relative to @zone->base
+ */
+static void __mark_used(struct buddy_zone *zone, unsigned int r, unsigned int nr)
+{
+	for (unsigned int i = r; i < r + nr; i++) {
+		set_bit(i, zone->used_frames);
+		if (!~zone->used_frames[BIT_WORD(i)]) {
+			set_bit(BIT_WORD(i), zone->full_words);
+		}
+	}
+	zone->nr_free -= nr;
+}
+
+/**
+ * Take the free block of @found_order containing the frame @r, and split it
+ * until the block of @order containing @r is left. The other halves are put
+ * back to @zone->free_area.
+ */
+static void __take_block(struct buddy_zone *zone, unsigned int r,
+		unsigned int found_order, unsigned int order)
+{
+	clear_bit(r >> found_order, zone->free_area[found_order]);
+
+	while (found_order > order) {
+		found_order--;
+		set_bit((r >> found_order) ^ 1, zone->free_area[found_order]);
+	}
+
+	r &= ~((1U << order) - 1);
+	__mark_used(zone, r, 1U << order);
+}
+
+void buddy_init(struct buddy_zone *zone, unsigned int base, unsigned int nr_frames)
+{
+	unsigned int nr_words = BITS_TO_LONGS(nr_frames);
+	unsigned int r = 0;
+
+	zone->base = base;
+	zone->nr_frames = nr_frames;
+	zone->nr_free = nr_frames;
+
+	for (unsigned int order = 0; order < MAX_ORDER; order++) {
+		zone->free_area[order] = calloc(BITS_TO_LONGS(__nr_blocks(zone, order)) + 1,
+				sizeof(unsigned long));
+	}
+	zone->used_frames = calloc(nr_words + 1, sizeof(unsigned long));
+	zone->full_words = calloc(BITS_TO_LONGS(nr_words) + 1, sizeof(unsigned long));
+
+	/* Frames beyond the zone in the last word are never available */
+	for (unsigned int i = nr_frames; i < nr_words * BITS_PER_LONG; i++) {
+		set_bit(i, zone->used_frames);
+	}
+	if (nr_words && !~zone->used_frames[nr_words - 1]) {
+		set_bit(nr_words - 1, zone->full_words);
+	}
+
+	/* Carve the frames into the largest aligned blocks */
+	while (r < nr_frames) {
+		unsigned int order = 0;
+
+		while (order + 1 < MAX_ORDER &&
+				!(r & ((1U << (order + 1)) - 1)) &&
+				r + (1U << (order + 1)) <= nr_frames) {
+			order++;
+		}
+		set_bit(r >> order, zone->free_area[order]);
+		r += 1U << order;
+	}
+}
+
+int buddy_alloc(struct buddy_zone *zone, unsigned int order)
+{
+	unsigned int nr_words = BITS_TO_LONGS(zone->nr_frames);
+	unsigned int found_order = MAX_ORDER;
+	unsigned int r = 0;
+
+	if (order >= MAX_ORDER) return -1;
+
+	if (order == 0) {
+		unsigned int word = find_first_zero_bit(zone->full_words, nr_words);
+
+		if (word == nr_words) return -1;
+
+		/* The smallest free frame belongs to a free block of some order */
+		r = word * BITS_PER_LONG + ffz(zone->used_frames[word]);
+		for (found_order = 0; found_order < MAX_ORDER; found_order++) {
+			if (test_bit(r >> found_order, zone->free_area[found_order])) break;
+		}
+		assert(found_order < MAX_ORDER);
+	} else {
+		for (unsigned int o = order; o < MAX_ORDER; o++) {
+			unsigned int nr_blocks = __nr_blocks(zone, o);
+			unsigned int block = find_first_bit(zone->free_area[o], nr_blocks);
+
+			if (block == nr_blocks) continue;
+			if (found_order == MAX_ORDER || (block << o) < r) {
+				r = block << o;
+				found_order = o;
+			}
+		}
+		if (found_order == MAX_ORDER) return -1;
+	}
+
+	__take_block(zone, r, found_order, order);
+
+	return zone->base + r;
+}
+
+bool buddy_take(struct buddy_zone *zone, unsigned int pfn)
+{
+	unsigned int r = pfn - zone->base;
+
+	if (r >= zone->nr_frames) return false;
+
+	for (unsigned int order = 0; order < MAX_ORDER; order++) {
+		if (test_bit(r >> order, zone->free_area[order])) {
+			__take_block(zone, r, order, 0);
+			return true;
+		}
+	}
+	return false;
+}
+
+void buddy_free(struct buddy_zone *zone, unsigned int pfn)
+{
+	unsigned int r = pfn - zone->base;
+	unsigned int order = 0;
+
+	assert(test_bit(r, zone->used_frames));
+
+	clear_bit(r, zone->used_frames);
+	clear_bit(BIT_WORD(r), zone->full_words);
+	zone->nr_free++;
+
+	/* Merge with the buddy as long as the buddy is free as a whole */
+	while (order + 1 < MAX_ORDER) {
+		unsigned int buddy = (r >> order) ^ 1;
+
+		if (buddy >= __nr_blocks(zone, order)) break;
+		if (!test_bit(buddy, zone->free_area[order])) break;
+
+		clear_bit(buddy, zone->free_area[order]);
+		order++;
+		r &= ~((1U << order) - 1);
+	}
+	set_bit(r >> order, zone->free_area[order]);
+}
+
+unsigned int buddy_nr_free_blocks(struct buddy_zone *zone, unsigned int order)
+{
+	unsigned int nr_blocks = 0;
+
+	for (unsigned int i = 0; i < BITS_TO_LONGS(__nr_blocks(zone, order)); i++) {
+		nr_blocks += __builtin_popcountl(zone->free_area[order][i]);
+	}
+	return nr_blocks;
+}
+
+void buddy_destroy(struct buddy_zone *zone)
+{
+	for (unsigned int order = 0; order < MAX_ORDER; order++) {
+		free(zone->free_area[order]);
+		zone->free_area[order] = NULL;
+	}
+	free(zone->used_frames);
+	free(zone->full_words);
+	zone->used_frames = zone->full_words = NULL;
+}
@@ -0,0 +1,107 @@
+/**********************************************************************
+ * Copyright (c) 2020-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __BUDDY_H__
+#define __BUDDY_H__
+
+#include "types.h"
+
+/* Blocks of up to 2^(MAX_ORDER - 1) page frames are managed */
+#define MAX_ORDER	11
+
+/**
+ * Buddy allocator over the page frames [@base, @base + @nr_frames).
+ *
+ * A block of order k consists of 2^k page frames aligned to 2^k from @base.
+ * @free_area[k] is the bitmap of the free blocks of order k; a free block is
+ * always merged with its buddy when the buddy is also free, so a bit in
+ * @free_area[k] stands for a maximal free block.
+ *
+ * @used_frames is set for each page frame in use, and @full_words
+ * summarizes @used_frames by setting the bit for a word when all frames in
+ * the word are in use. They allow to find the smallest free page frame
+ * without walking through @free_area.
+ */
+struct buddy_zone {
+	unsigned int base;
+	unsigned int nr_frames;
+	unsigned int nr_free;
+
+	unsigned long *free_area[MAX_ORDER];
+	unsigned long *used_frames;
+	unsigned long *full_words;
+};
+
+/**
+ * buddy_init(@zone, @base, @nr_frames)
+ *
+ * DESCRIPTION
+ *   Initialize @zone to manage @nr_frames page frames starting from @base.
+ *   All page frames are free at the beginning.
+ */
+void buddy_init(struct buddy_zone *zone, unsigned int base, unsigned int nr_frames);
+
+/**
+ * buddy_alloc(@zone, @order)
+ *
+ * DESCRIPTION
+ *   Allocate 2^@order contiguous page frames aligned to 2^@order. Among the
+ *   candidates, the block with the smallest pfn is allocated.
+ *
+ * RETURN
+ *   The first pfn of the allocated block
+ *   -1 if no free block of @order is available
+ */
+int buddy_alloc(struct buddy_zone *zone, unsigned int order);
+
+/**
+ * buddy_take(@zone, @pfn)
+ *
+ * DESCRIPTION
+ *   Allocate the page frame @pfn in particular, splitting the free block
+ *   containing it.
+ *
+ * RETURN
+ *   @true if @pfn is allocated
+ *   @false if @pfn is in use already
+ */
+bool buddy_take(struct buddy_zone *zone, unsigned int pfn);
+
+/**
+ * buddy_free(@zone, @pfn)
+ *
+ * DESCRIPTION
+ *   Free the page frame @pfn, and merge it with its free buddies.
+ */
+void buddy_free(struct buddy_zone *zone, unsigned int pfn);
+
+/**
+ * buddy_nr_free_blocks(@zone, @order)
+ *
+ * DESCRIPTION
+ *   Count the free blocks of @order in @zone. The free frames in larger
+ *   blocks are not counted.
+ */
+unsigned int buddy_nr_free_blocks(struct buddy_zone *zone, unsigned int order);
+
+/**
+ * buddy_destroy(@zone)
+ *
+ * DESCRIPTION
+ *   Release the bitmaps of @zone. @zone should be initialized again to be
+ *   used afterward.
+ */
+void buddy_destroy(struct buddy_zone *zone);
+
+#endif
@@ -0,0 +1,861 @@
+/**********************************************************************
+ * Copyright (c) 2020-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "list_head.h"
+#include "bitmap.h"
+#include "vm.h"
+#include "checkpoint.h"
+
+/**
+ * Layout of checkpoints. The header is followed by the sections below in
+ * this order:
+ *
+ *   struct checkpoint_system, and then the raw struct vm_stats, the
+ *     operation summary, and the MMU state of struct vm_instance
+ *   @nr_directories directories, each of which is struct checkpoint_directory
+ *     followed by NR_PTES_PER_PAGE struct checkpoint_pte
+ *   @nr_processes struct checkpoint_process
+ *   For each CPU, struct checkpoint_cpu followed by its TLB entries in raw,
+ *     the CLOCK hands of its TLB sets, and struct checkpoint_pwc
+ *   struct checkpoint_frame for each page frame, and the bitmap of the page
+ *     frames in use
+ *   The bitmap of the swap slots in use, and struct checkpoint_slot for each
+ *     swap slot
+ *   struct checkpoint_rmap of the page frames in order, and then of the
+ *     swap slots
+ *
+ * Records are padded to multiples of 8 bytes to be read in place.
+ */
+struct checkpoint_header {
+	char magic[4];
+	uint32_t version;
+	struct vm_config cfg;
+	uint64_t nr_directories;	/* 64-bit to keep the header aligned */
+	uint64_t nr_processes;
+};
+
+#define NR_POOLS	3
+
+struct checkpoint_system {
+	uint64_t frame_clock;
+	uint64_t swap_seq;
+	uint32_t swap_hand;
+	uint32_t zero_pfn;
+	struct {
+		uint64_t nr_inuse;
+		uint64_t max_inuse;
+		uint64_t nr_allocs;
+		uint64_t nr_frees;
+	} pools[NR_POOLS];
+};
+
+/* @pfn is the index of the directory if the entry points to one */
+struct checkpoint_pte {
+	uint8_t valid;
+	uint8_t huge;
+	uint8_t swapped;
+	uint8_t lazy;
+	uint8_t accessed;
+	uint8_t dirty;
+	uint16_t rw;
+	uint32_t pfn;
+	uint32_t private;
+};
+
+struct checkpoint_directory {
+	uint32_t level;
+	uint32_t refcount;
+	uint32_t nr_valid;
+	uint32_t pad;
+};
+
+/* The processes in the ready queue come first in the order of the queue */
+struct checkpoint_process {
+	uint32_t pid;
+	uint32_t asid;
+	int32_t cpu;		/* The CPU running this, or -1 if ready */
+	uint32_t init;		/* This is the initial process */
+	int32_t lender;		/* Index of the vfork parent borrowed from, or -1 */
+	uint32_t pad;
+	uint64_t asid_generation;
+	uint64_t nr_tlb_hits;
+	uint64_t nr_tlb_misses;
+	uint32_t wss;
+	uint32_t max_wss;
+	uint64_t wss_sum;
+	uint64_t nr_wss_samples;
+	uint32_t mem_policy;
+	uint32_t preferred_node;
+	uint32_t next_node;
+	uint32_t pad2;
+	uint64_t nr_local_accesses;
+	uint64_t nr_remote_accesses;
+	uint64_t cycles[NR_COST_EVENTS];
+	uint64_t nr_accesses;
+	uint64_t access_cycles;
+	uint64_t cpumask;
+	struct checkpoint_pte root;
+};
+
+struct checkpoint_cpu {
+	uint32_t last_vpn;
+	int32_t last_stride;
+	int32_t prefetch_stride;
+	uint32_t pad;
+};
+
+struct checkpoint_pwc {
+	uint32_t valid;
+	uint32_t tag;
+	uint32_t dir;
+	uint32_t rw;
+	uint64_t stamp;
+};
+
+struct checkpoint_frame {
+	uint64_t seq;
+	uint64_t stamp;
+	uint32_t referenced;
+	uint32_t nr_huge_maps;
+	uint32_t mapcount;
+	uint32_t nr_rmaps;
+};
+
+struct checkpoint_slot {
+	uint32_t count;
+	uint32_t nr_rmaps;
+};
+
+/* The PTE at @index in the directory @dir */
+struct checkpoint_rmap {
+	uint32_t dir;
+	uint32_t index;
+};
+
+/* The CLOCK hands are saved for an even number of sets to keep the alignment */
+#define NR_SAVED_HANDS	((vm->config.tlb_sets + 1) & ~1U)
+
+static void __get_pools(struct pool *pools[NR_POOLS])
+{
+	pools[0] = &vm->directory_pool;
+	pools[1] = &vm->process_pool;
+	pools[2] = &vm->rmap_pool;
+}
+
+
+/**
+ * Saving checkpoints. The directories of all page tables are collected and
+ * sorted by their addresses first, so that the index of the directory that
+ * a pointer points into is found with binary search.
+ */
+struct directory_ref {
+	struct pte_directory *dir;
+	unsigned int level;
+};
+
+struct checkpoint_writer {
+	FILE *out;
+	bool failed;
+
+	struct directory_ref *dirs;
+	unsigned int nr_dirs;
+	unsigned int max_dirs;
+};
+
+static void __put(struct checkpoint_writer *w, const void *data, size_t size)
+{
+	if (w->failed || !size) return;
+	if (fwrite(data, size, 1, w->out) != 1) w->failed = true;
+}
+
+static void __collect_directory(struct checkpoint_writer *w,
+		struct pte_directory *dir, unsigned int level)
+{
+	if (w->nr_dirs == w->max_dirs) {
+		w->max_dirs = w->max_dirs ? w->max_dirs * 2 : 64;
+		w->dirs = realloc(w->dirs, sizeof(*w->dirs) * w->max_dirs);
+	}
+	w->dirs[w->nr_dirs++] = (struct directory_ref) { .dir = dir, .level = level };
+
+	if (level + 1 == vm->config.nr_pt_levels) return;
+
+	for (unsigned int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		struct pte *pte = dir->ptes + i;
+
+		if (pte->valid && !pte->huge) __collect_directory(w, pte->dir, level + 1);
+	}
+}
+
+static int __compare_refs(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)((const struct directory_ref *)a)->dir;
+	uintptr_t y = (uintptr_t)((const struct directory_ref *)b)->dir;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Collect the directories of @p, and return @true if it is saved */
+static bool __collect_process(struct checkpoint_writer *w, struct process *p)
+{
+	if (!p) return false;
+	if (p->pagetable.root.valid) __collect_directory(w, p->pagetable.root.dir, 0);
+	return true;
+}
+
+/* The index of the directory that @addr points into */
+static unsigned int __directory_index(const struct checkpoint_writer *w, const void *addr)
+{
+	unsigned int lo = 0, hi = w->nr_dirs;
+
+	while (hi - lo > 1) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if ((uintptr_t)w->dirs[mid].dir <= (uintptr_t)addr) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	assert(lo < w->nr_dirs && (uintptr_t)w->dirs[lo].dir <= (uintptr_t)addr);
+	return lo;
+}
+
+/* The index of @dir itself */
+static unsigned int __directory_of(const struct checkpoint_writer *w,
+		const struct pte_directory *dir)
+{
+	unsigned int i = __directory_index(w, dir);
+
+	assert(w->dirs[i].dir == dir);
+	return i;
+}
+
+static void __save_pte(struct checkpoint_writer *w, const struct pte *pte, bool points_dir)
+{
+	struct checkpoint_pte c = {
+		.valid = pte->valid,
+		.huge = pte->huge,
+		.swapped = pte->swapped,
+		.lazy = pte->lazy,
+		.accessed = pte->accessed,
+		.dirty = pte->dirty,
+		.rw = pte->rw,
+		.private = pte->private,
+	};
+
+	if (points_dir && pte->valid && !pte->huge) {
+		c.pfn = __directory_of(w, pte->dir);
+	} else if (!points_dir || pte->huge) {
+		c.pfn = pte->pfn;
+	}
+	__put(w, &c, sizeof(c));
+}
+
+/* The index of @p in the ready queue, which is where vfork parents are */
+static int __queue_index(const struct process *p)
+{
+	const struct process *q;
+	int i = 0;
+
+	list_for_each_entry(q, &vm->processes, list) {
+		if (q == p) return i;
+		i++;
+	}
+	assert(!"vfork parent is not in the ready queue");
+	return -1;
+}
+
+static void __save_process(struct checkpoint_writer *w, const struct process *p, int cpu)
+{
+	struct checkpoint_process c = {
+		.pid = p->pid,
+		.asid = p->asid,
+		.cpu = cpu,
+		.init = p == &vm->init,
+		.lender = p->lender ? __queue_index(p->lender) : -1,
+		.asid_generation = p->asid_generation,
+		.nr_tlb_hits = p->nr_tlb_hits,
+		.nr_tlb_misses = p->nr_tlb_misses,
+		.wss = p->wss,
+		.max_wss = p->max_wss,
+		.wss_sum = p->wss_sum,
+		.nr_wss_samples = p->nr_wss_samples,
+		.mem_policy = p->mem_policy,
+		.preferred_node = p->preferred_node,
+		.next_node = p->next_node,
+		.nr_local_accesses = p->nr_local_accesses,
+		.nr_remote_accesses = p->nr_remote_accesses,
+		.nr_accesses = p->nr_accesses,
+		.access_cycles = p->access_cycles,
+		.cpumask = p->cpumask,
+	};
+
+	for (unsigned int i = 0; i < NR_COST_EVENTS; i++) {
+		c.cycles[i] = p->cycles[i];
+	}
+
+	__put(w, &c, offsetof(struct checkpoint_process, root));
+	__save_pte(w, &p->pagetable.root, true);
+}
+
+static void __save_cpu(struct checkpoint_writer *w, const struct cpu *cpu)
+{
+	struct checkpoint_cpu c = {
+		.last_vpn = cpu->last_vpn,
+		.last_stride = cpu->last_stride,
+		.prefetch_stride = cpu->prefetch_stride,
+	};
+
+	__put(w, &c, sizeof(c));
+	__put(w, cpu->tlb_entries, sizeof(struct tlb_entry) * vm->config.tlb_sets * vm->config.tlb_ways);
+	__put(w, cpu->tlb_hands, sizeof(uint32_t) * NR_SAVED_HANDS);
+
+	for (unsigned int i = 0; i < vm->config.nr_pwc_entries; i++) {
+		const struct pwc_entry *e = cpu->pwc_entries + i;
+		struct checkpoint_pwc pwc = {
+			.valid = e->valid,
+			.tag = e->tag,
+			.dir = e->valid ? __directory_of(w, e->dir) : 0,
+			.rw = e->rw,
+			.stamp = e->stamp,
+		};
+
+		__put(w, &pwc, sizeof(pwc));
+	}
+}
+
+static unsigned int __count_rmaps(const struct list_head *head)
+{
+	struct list_head *pos;
+	unsigned int nr = 0;
+
+	list_for_each(pos, head) nr++;
+	return nr;
+}
+
+static void __save_rmaps(struct checkpoint_writer *w, const struct list_head *head)
+{
+	struct rmap *rmap;
+
+	list_for_each_entry(rmap, head, list) {
+		unsigned int i = __directory_index(w, rmap->pte);
+		struct checkpoint_rmap c = {
+			.dir = i,
+			.index = rmap->pte - w->dirs[i].dir->ptes,
+		};
+
+		assert(c.index < NR_PTES_PER_PAGE);
+		__put(w, &c, sizeof(c));
+	}
+}
+
+bool checkpoint_save(const char *path)
+{
+	struct checkpoint_writer w = { .out = fopen(path, "wb") };
+	struct checkpoint_header header = {
+		.magic = CHECKPOINT_MAGIC,
+		.version = CHECKPOINT_VERSION,
+		.cfg = vm->config,
+	};
+	struct checkpoint_system sys = {
+		.frame_clock = vm->frame_clock,
+		.swap_seq = vm->swap.seq,
+		.swap_hand = vm->swap.hand,
+		.zero_pfn = vm->zero_pfn,
+	};
+	struct pool *pools[NR_POOLS];
+	struct process *p;
+	unsigned int nr_dirs = 0;
+	unsigned long *used_frames;
+
+	if (!w.out) {
+		fprintf(stderr, "Unable to create %s\n", path);
+		return false;
+	}
+
+	list_for_each_entry(p, &vm->processes, list) {
+		if (__collect_process(&w, p)) header.nr_processes++;
+	}
+	for (unsigned int i = 0; i < vm->config.nr_cpus; i++) {
+		if (__collect_process(&w, vm->cpus[i].curr)) header.nr_processes++;
+	}
+
+	/* Shared directories are collected as many times as they are shared */
+	if (w.nr_dirs) qsort(w.dirs, w.nr_dirs, sizeof(*w.dirs), __compare_refs);
+	for (unsigned int i = 0; i < w.nr_dirs; i++) {
+		if (!nr_dirs || w.dirs[i].dir != w.dirs[nr_dirs - 1].dir) {
+			w.dirs[nr_dirs++] = w.dirs[i];
+		}
+	}
+	w.nr_dirs = header.nr_directories = nr_dirs;
+
+	__get_pools(pools);
+	for (unsigned int i = 0; i < NR_POOLS; i++) {
+		sys.pools[i].nr_inuse = pools[i]->nr_inuse;
+		sys.pools[i].max_inuse = pools[i]->max_inuse;
+		sys.pools[i].nr_allocs = pools[i]->nr_allocs;
+		sys.pools[i].nr_frees = pools[i]->nr_frees;
+	}
+
+	__put(&w, &header, sizeof(header));
+	__put(&w, &sys, sizeof(sys));
+	__put(&w, &vm->stats, sizeof(vm->stats));
+	__put(&w, vm->summary, sizeof(vm->summary));
+	__put(&w, &vm->mmu, sizeof(vm->mmu));
+
+	for (unsigned int i = 0; i < w.nr_dirs; i++) {
+		struct pte_directory *dir = w.dirs[i].dir;
+		struct checkpoint_directory c = {
+			.level = w.dirs[i].level,
+			.refcount = dir->refcount,
+			.nr_valid = dir->nr_valid,
+		};
+
+		__put(&w, &c, sizeof(c));
+		for (unsigned int j = 0; j < NR_PTES_PER_PAGE; j++) {
+			__save_pte(&w, dir->ptes + j, c.level + 1 < vm->config.nr_pt_levels);
+		}
+	}
+
+	list_for_each_entry(p, &vm->processes, list) {
+		__save_process(&w, p, -1);
+	}
+	for (unsigned int i = 0; i < vm->config.nr_cpus; i++) {
+		if (vm->cpus[i].curr) __save_process(&w, vm->cpus[i].curr, i);
+	}
+
+	for (unsigned int i = 0; i < vm->config.nr_cpus; i++) {
+		__save_cpu(&w, vm->cpus + i);
+	}
+
+	for (unsigned int i = 0; i < vm->config.nr_pageframes; i++) {
+		struct checkpoint_frame c = {
+			.seq = vm->frames[i].seq,
+			.stamp = vm->frames[i].stamp,
+			.referenced = vm->frames[i].referenced,
+			.nr_huge_maps = vm->frames[i].nr_huge_maps,
+			.mapcount = vm->mapcounts[i],
+			.nr_rmaps = __count_rmaps(&vm->frames[i].rmap),
+		};
+
+		__put(&w, &c, sizeof(c));
+	}
+	/* The frames in use in all the nodes are saved in one bitmap */
+	used_frames = calloc(BITS_TO_LONGS(vm->config.nr_pageframes), sizeof(unsigned long));
+	for (unsigned int i = 0; i < vm->config.nr_pageframes; i++) {
+		struct buddy_zone *zone = &vm->frame_zones[frame_node(i)];
+
+		if (test_bit(i - zone->base, zone->used_frames)) set_bit(i, used_frames);
+	}
+	__put(&w, used_frames, sizeof(unsigned long) * BITS_TO_LONGS(vm->config.nr_pageframes));
+	free(used_frames);
+
+	__put(&w, vm->swap.slot_map, sizeof(unsigned long) * BITS_TO_LONGS(vm->config.nr_swap_slots));
+	for (unsigned int i = 0; i < vm->config.nr_swap_slots; i++) {
+		struct checkpoint_slot c = {
+			.count = vm->swap.slot_counts[i],
+			.nr_rmaps = __count_rmaps(&vm->swap.slot_rmaps[i]),
+		};
+
+		__put(&w, &c, sizeof(c));
+	}
+
+	for (unsigned int i = 0; i < vm->config.nr_pageframes; i++) {
+		__save_rmaps(&w, &vm->frames[i].rmap);
+	}
+	for (unsigned int i = 0; i < vm->config.nr_swap_slots; i++) {
+		__save_rmaps(&w, &vm->swap.slot_rmaps[i]);
+	}
+
+	free(w.dirs);
+	if (fclose(w.out)) w.failed = true;
+	if (w.failed) {
+		fprintf(stderr, "Unable to write the checkpoint to %s\n", path);
+		remove(path);
+		return false;
+	}
+	return true;
+}
+
+
+/**
+ * Restoring checkpoints. All directories are allocated first, so that the
+ * indices of directories are turned into pointers as they come.
+ */
+struct checkpoint_reader {
+	const char *pos;
+	const char *end;
+
+	struct pte_directory **dirs;
+	unsigned int nr_dirs;
+};
+
+/* Take the next @size bytes of the checkpoint, or NULL if it is too short */
+static const void *__get(struct checkpoint_reader *r, size_t size)
+{
+	const void *data = r->pos;
+
+	if ((size_t)(r->end - r->pos) < size) return NULL;
+	r->pos += size;
+	return data;
+}
+
+/* Policies and the output mode may differ from the saved system */
+static bool __same_configuration(const struct vm_config *cfg)
+{
+	return cfg->tlb_sets == vm->config.tlb_sets &&
+		cfg->tlb_ways == vm->config.tlb_ways &&
+		cfg->nr_pwc_entries == vm->config.nr_pwc_entries &&
+		cfg->nr_asids == vm->config.nr_asids &&
+		cfg->nr_pageframes == vm->config.nr_pageframes &&
+		cfg->nr_pt_levels == vm->config.nr_pt_levels &&
+		cfg->ptes_per_page_shift == vm->config.ptes_per_page_shift &&
+		cfg->nr_cpus == vm->config.nr_cpus &&
+		cfg->nr_nodes == vm->config.nr_nodes &&
+		cfg->nr_swap_slots == vm->config.nr_swap_slots &&
+		cfg->lazy_alloc == vm->config.lazy_alloc;
+}
+
+static bool __restore_pte(struct checkpoint_reader *r, struct pte *pte,
+		const struct checkpoint_pte *c, bool points_dir)
+{
+	pte->valid = c->valid;
+	pte->huge = c->huge;
+	pte->swapped = c->swapped;
+	pte->lazy = c->lazy;
+	pte->accessed = c->accessed;
+	pte->dirty = c->dirty;
+	pte->rw = c->rw;
+	pte->private = c->private;
+	pte->dir = NULL;
+
+	if (points_dir && c->valid && !c->huge) {
+		if (c->pfn >= r->nr_dirs) return false;
+		pte->dir = r->dirs[c->pfn];
+	} else if (!points_dir || c->huge) {
+		pte->pfn = c->pfn;
+	}
+	return true;
+}
+
+static bool __restore_directories(struct checkpoint_reader *r, unsigned int nr_dirs)
+{
+	size_t size = sizeof(struct checkpoint_directory) +
+			sizeof(struct checkpoint_pte) * NR_PTES_PER_PAGE;
+
+	if ((size_t)(r->end - r->pos) / size < nr_dirs) return false;
+
+	r->dirs = malloc(sizeof(*r->dirs) * nr_dirs);
+	for (unsigned int i = 0; i < nr_dirs; i++) {
+		r->dirs[i] = pool_alloc(&vm->directory_pool);
+	}
+	r->nr_dirs = nr_dirs;
+
+	for (unsigned int i = 0; i < nr_dirs; i++) {
+		const struct checkpoint_directory *c = __get(r, sizeof(*c));
+		const struct checkpoint_pte *ptes = __get(r, sizeof(*ptes) * NR_PTES_PER_PAGE);
+		struct pte_directory *dir = r->dirs[i];
+
+		if (!c || !ptes || c->level >= vm->config.nr_pt_levels) return false;
+
+		dir->refcount = c->refcount;
+		dir->nr_valid = c->nr_valid;
+		for (unsigned int j = 0; j < NR_PTES_PER_PAGE; j++) {
+			if (!__restore_pte(r, dir->ptes + j, ptes + j,
+						c->level + 1 < vm->config.nr_pt_levels)) return false;
+		}
+	}
+	return true;
+}
+
+/* The process at @index of the ready queue */
+static struct process *__queue_at(unsigned int index)
+{
+	struct process *p;
+
+	list_for_each_entry(p, &vm->processes, list) {
+		if (!index--) return p;
+	}
+	return NULL;
+}
+
+static bool __restore_processes(struct checkpoint_reader *r, unsigned int nr_processes)
+{
+	const struct checkpoint_process *records = (const void *)r->pos;
+	unsigned int nr_ready = 0;
+	bool init_restored = false;
+	struct process *p;
+
+	vm->cpus[0].curr = NULL;
+	vm->cpus[0].pt_base = NULL;
+
+	for (unsigned int i = 0; i < nr_processes; i++) {
+		const struct checkpoint_process *c = __get(r, sizeof(*c));
+
+		if (!c) return false;
+		if (c->init && init_restored) return false;
+		if (c->cpu >= 0 && (c->cpu >= vm->config.nr_cpus || vm->cpus[c->cpu].curr)) return false;
+		if (c->mem_policy >= NR_MEM_POLICIES || c->preferred_node >= vm->config.nr_nodes ||
+				c->next_node >= vm->config.nr_nodes) return false;
+		/* The ready queue comes first, so lenders are indexed as in the queue */
+		if (c->cpu < 0 && nr_ready++ != i) return false;
+
+		if (c->init) {
+			p = &vm->init;
+			init_restored = true;
+		} else {
+			p = pool_alloc(&vm->process_pool);
+		}
+		p->pid = c->pid;
+		p->asid = c->asid;
+		p->asid_generation = c->asid_generation;
+		p->nr_tlb_hits = c->nr_tlb_hits;
+		p->nr_tlb_misses = c->nr_tlb_misses;
+		p->wss = c->wss;
+		p->max_wss = c->max_wss;
+		p->wss_sum = c->wss_sum;
+		p->nr_wss_samples = c->nr_wss_samples;
+		p->mem_policy = c->mem_policy;
+		p->preferred_node = c->preferred_node;
+		p->next_node = c->next_node;
+		p->nr_local_accesses = c->nr_local_accesses;
+		p->nr_remote_accesses = c->nr_remote_accesses;
+		for (unsigned int j = 0; j < NR_COST_EVENTS; j++) {
+			p->cycles[j] = c->cycles[j];
+		}
+		p->nr_accesses = c->nr_accesses;
+		p->access_cycles = c->access_cycles;
+		p->cpumask = c->cpumask;
+		p->lender = NULL;
+		p->nr_borrowers = 0;
+		INIT_LIST_HEAD(&p->list);
+		INIT_HLIST_NODE(&p->hash);
+		if (!__restore_pte(r, &p->pagetable.root, &c->root, true)) return false;
+
+		if (c->cpu < 0) {
+			list_add_tail(&p->list, &vm->processes);
+		} else {
+			vm->cpus[c->cpu].curr = p;
+			vm->cpus[c->cpu].pt_base = &p->pagetable;
+		}
+	}
+
+	for (unsigned int i = 0; i < nr_processes; i++) {
+		const struct checkpoint_process *c = records + i;
+		struct process *lender;
+
+		if (c->lender < 0) continue;
+		if (c->lender == i || c->lender >= nr_ready || records[c->lender].lender >= 0)
+			return false;
+
+		lender = __queue_at(c->lender);
+		p = c->cpu < 0 ? __queue_at(i) : vm->cpus[c->cpu].curr;
+		if (p->pagetable.root.valid != lender->pagetable.root.valid ||
+				p->pagetable.root.dir != lender->pagetable.root.dir) return false;
+		p->lender = lender;
+		lender->nr_borrowers++;
+	}
+
+	/* Hash them backward so that each bucket is in the order of the queue */
+	list_for_each_entry_reverse(p, &vm->processes, list) {
+		hlist_add_head(&p->hash, &vm->pid_hash[pid_hashfn(p->pid)]);
+	}
+	return true;
+}
+
+static bool __restore_cpu(struct checkpoint_reader *r, struct cpu *cpu)
+{
+	unsigned int nr_entries = vm->config.tlb_sets * vm->config.tlb_ways;
+	const struct checkpoint_cpu *c = __get(r, sizeof(*c));
+	const struct tlb_entry *entries = __get(r, sizeof(*entries) * nr_entries);
+	const uint32_t *hands = __get(r, sizeof(*hands) * NR_SAVED_HANDS);
+	const struct checkpoint_pwc *pwc = __get(r, sizeof(*pwc) * vm->config.nr_pwc_entries);
+
+	if (!c || !entries || !hands || (vm->config.nr_pwc_entries && !pwc)) return false;
+
+	cpu->last_vpn = c->last_vpn;
+	cpu->last_stride = c->last_stride;
+	cpu->prefetch_stride = c->prefetch_stride;
+	memcpy(cpu->tlb_entries, entries, sizeof(*entries) * nr_entries);
+	for (unsigned int i = 0; i < nr_entries; i++) {
+		cpu->tlb_tags[i] = tlb_entry_tag(entries + i);
+	}
+	for (unsigned int i = 0; i < NR_SAVED_HANDS; i++) {
+		cpu->tlb_hands[i] = hands[i];
+	}
+
+	for (unsigned int i = 0; i < vm->config.nr_pwc_entries; i++) {
+		struct pwc_entry *e = cpu->pwc_entries + i;
+
+		if (pwc[i].valid && pwc[i].dir >= r->nr_dirs) return false;
+
+		e->valid = pwc[i].valid;
+		e->tag = pwc[i].tag;
+		e->dir = pwc[i].valid ? r->dirs[pwc[i].dir] : NULL;
+		e->rw = pwc[i].rw;
+		e->stamp = pwc[i].stamp;
+	}
+	return true;
+}
+
+static bool __restore_rmaps(struct checkpoint_reader *r, struct list_head *head,
+		unsigned int nr_rmaps)
+{
+	const struct checkpoint_rmap *c = __get(r, sizeof(*c) * nr_rmaps);
+
+	if (nr_rmaps && !c) return false;
+
+	for (unsigned int i = 0; i < nr_rmaps; i++) {
+		struct rmap *rmap;
+
+		if (c[i].dir >= r->nr_dirs || c[i].index >= NR_PTES_PER_PAGE) return false;
+
+		rmap = pool_alloc(&vm->rmap_pool);
+		rmap->pte = r->dirs[c[i].dir]->ptes + c[i].index;
+		list_add_tail(&rmap->list, head);
+	}
+	return true;
+}
+
+static bool __restore(struct checkpoint_reader *r, const struct checkpoint_header *header)
+{
+	const struct checkpoint_system *sys = __get(r, sizeof(*sys));
+	const struct vm_stats *saved_stats = __get(r, sizeof(vm->stats));
+	const void *summary = __get(r, sizeof(vm->summary));
+	const void *mmu = __get(r, sizeof(vm->mmu));
+	const struct checkpoint_frame *frame_records;
+	const struct checkpoint_slot *slot_records;
+	const unsigned long *used_frames, *slot_map;
+	struct pool *pools[NR_POOLS];
+
+	if (!sys || !saved_stats || !summary || !mmu) return false;
+
+	vm->frame_clock = sys->frame_clock;
+	vm->swap.seq = sys->swap_seq;
+	vm->swap.hand = sys->swap_hand;
+	vm->zero_pfn = sys->zero_pfn;
+	vm->stats = *saved_stats;
+	memcpy(vm->summary, summary, sizeof(vm->summary));
+	memcpy(&vm->mmu, mmu, sizeof(vm->mmu));
+
+	if (!__restore_directories(r, header->nr_directories)) return false;
+	if (!__restore_processes(r, header->nr_processes)) return false;
+
+	for (unsigned int i = 0; i < vm->config.nr_cpus; i++) {
+		if (!__restore_cpu(r, vm->cpus + i)) return false;
+	}
+	vm->this_cpu = vm->cpus;
+
+	frame_records = __get(r, sizeof(*frame_records) * vm->config.nr_pageframes);
+	used_frames = __get(r, sizeof(*used_frames) * BITS_TO_LONGS(vm->config.nr_pageframes));
+	if (!frame_records || !used_frames) return false;
+
+	for (unsigned int i = 0; i < vm->config.nr_pageframes; i++) {
+		vm->frames[i].seq = frame_records[i].seq;
+		vm->frames[i].stamp = frame_records[i].stamp;
+		vm->frames[i].referenced = frame_records[i].referenced;
+		vm->frames[i].nr_huge_maps = frame_records[i].nr_huge_maps;
+		vm->mapcounts[i] = frame_records[i].mapcount;
+
+		if (test_bit(i, used_frames) && !buddy_take(&vm->frame_zones[frame_node(i)], i)) {
+			return false;
+		}
+	}
+
+	slot_map = __get(r, sizeof(*slot_map) * BITS_TO_LONGS(vm->config.nr_swap_slots));
+	slot_records = __get(r, sizeof(*slot_records) * vm->config.nr_swap_slots);
+	if (vm->config.nr_swap_slots && (!slot_map || !slot_records)) return false;
+
+	memcpy(vm->swap.slot_map, slot_map, sizeof(*slot_map) * BITS_TO_LONGS(vm->config.nr_swap_slots));
+	for (unsigned int i = 0; i < vm->config.nr_swap_slots; i++) {
+		vm->swap.slot_counts[i] = slot_records[i].count;
+	}
+
+	for (unsigned int i = 0; i < vm->config.nr_pageframes; i++) {
+		if (!__restore_rmaps(r, &vm->frames[i].rmap, frame_records[i].nr_rmaps)) return false;
+	}
+	for (unsigned int i = 0; i < vm->config.nr_swap_slots; i++) {
+		if (!__restore_rmaps(r, &vm->swap.slot_rmaps[i], slot_records[i].nr_rmaps)) {
+			return false;
+		}
+	}
+
+	/* The pools go on counting from the saved system */
+	__get_pools(pools);
+	for (unsigned int i = 0; i < NR_POOLS; i++) {
+		pools[i]->nr_inuse = sys->pools[i].nr_inuse;
+		pools[i]->max_inuse = sys->pools[i].max_inuse;
+		pools[i]->nr_allocs = sys->pools[i].nr_allocs;
+		pools[i]->nr_frees = sys->pools[i].nr_frees;
+	}
+
+	return r->pos == r->end;
+}
+
+bool checkpoint_restore(const char *path)
+{
+	int fd;
+	struct stat st;
+	void *map;
+	struct checkpoint_reader r = { NULL };
+	const struct checkpoint_header *header;
+	bool ret = false;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "No checkpoint %s\n", path);
+		return false;
+	}
+	if (fstat(fd, &st) || st.st_size < sizeof(*header)) {
+		fprintf(stderr, "%s is not a checkpoint\n", path);
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Unable to map %s\n", path);
+		return false;
+	}
+	r.pos = map;
+	r.end = r.pos + st.st_size;
+
+	header = __get(&r, sizeof(*header));
+	if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) ||
+			header->version != CHECKPOINT_VERSION) {
+		fprintf(stderr, "%s is not a checkpoint\n", path);
+	} else if (!__same_configuration(&header->cfg)) {
+		fprintf(stderr, "%s is from a system configured differently\n", path);
+	} else if (!(ret = __restore(&r, header))) {
+		fprintf(stderr, "%s is corrupted\n", path);
+	}
+
+	free(r.dirs);
+	munmap(map, st.st_size);
+	return ret;
+}
@@ -0,0 +1,60 @@
+/**********************************************************************
+ * Copyright (c) 2020-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include "types.h"
+
+/**
+ * Checkpoints save the whole state of the system that @vm simulates, so that
+ * a simulation can go on from there later without simulating the operations
+ * up to it again.
+ *
+ * A checkpoint is a sequence of fixed-size records stored in the host byte
+ * order, and is mapped into memory to be restored. Pointers are saved as
+ * the indices of the directories and processes they point to. The geometry
+ * of the system should be the same to restore a checkpoint, whereas the
+ * policies may differ from the ones of the saved system.
+ */
+#define CHECKPOINT_MAGIC	"VMCP"
+#define CHECKPOINT_VERSION	7
+
+/**
+ * checkpoint_save(@path)
+ *
+ * DESCRIPTION
+ *   Save the state of the system to the file at @path.
+ *
+ * RETURN
+ *   @true if the checkpoint is saved
+ *   @false if unable to write the file
+ */
+bool checkpoint_save(const char *path);
+
+/**
+ * checkpoint_restore(@path)
+ *
+ * DESCRIPTION
+ *   Restore the state of the system from the checkpoint at @path. The system
+ *   should be initialized but not simulated yet.
+ *
+ * RETURN
+ *   @true if the state is restored
+ *   @false if @path is not a checkpoint of the system. The system may be
+ *   partially restored, and should be released
+ */
+bool checkpoint_restore(const char *path);
+
+#endif
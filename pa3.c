@@ -15,37 +15,406 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #include "types.h"
 #include "list_head.h"
+#include "bitmap.h"
+#include "buddy.h"
+#include "pool.h"
 #include "vm.h"
 
 /**
- * Ready queue of the system
+ * The state of the system is in the instance that this thread simulates:
+ *
+ * @processes: Ready queue of the system, and @pid_hash to find the processes
+ * in it by their pids.
+ *
+ * @cpus: CPUs of the system. @current, @ptbr that MMU will walk through for
+ * address translation, and @tlb stand for the ones of @this_cpu.
+ *
+ * @mapcounts: The number of mappings for each page frame. Can be used to
+ * determine how many processes are using the page frames. @frames has the
+ * state of each frame for the page replacement, and the reverse mappings
+ * to the PTEs mapping the frame.
+ *
+ * @frame_zones: Buddy allocators of the page frames in each memory node.
+ *
+ * @directory_pool, @process_pool, and @rmap_pool: Object pools for page
+ * directories, processes, and reverse mappings.
+ *
+ * @stats: Event counters of the system.
+ *
+ * @vm->mmu has the state of TLBs and ASIDs. TLB entries are stamped with
+ * @tlb_seq in their insertion order, and with @tlb_clock on their last use
+ * for LRU. @tlb_random is the state of the pseudo-random number generator
+ * for the RANDOM policy; the sequence is fixed so that a run can be repeated
+ * with the same result. @next_asid is the next ASID to assign in
+ * @asid_generation, and @init owns ASID 0 of generation 0 from the
+ * beginning. @tlb_batch has the shootdowns to send at the end of the current
+ * operation; @cpumask is the CPUs to interrupt, and @nr_entries counts the
+ * invalidations requested. @nr_huge_mappings is the number of huge page
+ * mappings in the system, and TLB is looked up for huge pages only when
+ * there are some.
+ *
+ * @vm->swap has the state of the swap device. A slot is in use while some
+ * swapped PTEs refer to it, counted by @slot_counts. The PTEs are found
+ * through @slot_rmaps like the PTEs mapping a page frame are through the
+ * @rmap of the frame. Thus, a page moves between its frame and slot with
+ * its reverse mappings.
+ *
+ * @vm->zero_pfn is the page frame that lazily allocated pages map for reads
+ * until they are written. It is allocated on the first such read, and holds
+ * an extra mapcount to be never freed nor evicted.
+ */
+
+
+/**
+ * __fill_tlb_entry(@cpu, @t, @asid, @vpn, @huge)
+ *
+ * DESCRIPTION
+ *   Make the entry @t in the TLB of @cpu cache @vpn of @asid, or the huge
+ *   page from @vpn with @huge, and tag it so.
+ */
+static inline void __fill_tlb_entry(struct cpu *cpu, struct tlb_entry *t,
+		unsigned int asid, unsigned int vpn, bool huge)
+{
+	t->valid = true;
+	t->huge = huge;
+	t->asid = asid;
+	t->vpn = vpn;
+	cpu->tlb_tags[t - cpu->tlb_entries] = tlb_tag(asid, vpn, huge);
+}
+
+
+/**
+ * __invalidate_tlb_entry(@cpu, @t)
+ *
+ * DESCRIPTION
+ *   Invalidate the entry @t in the TLB of @cpu along with its tag.
+ */
+static inline void __invalidate_tlb_entry(struct cpu *cpu, struct tlb_entry *t)
+{
+	t->valid = false;
+	cpu->tlb_tags[t - cpu->tlb_entries] = 0;
+}
+
+
+/**
+ * __match_tlb_tag(@tags, @tag, @nr)
+ *
+ * DESCRIPTION
+ *   Look for @tag in the @nr tags from @tags. The tags are compared four at
+ *   once with AVX2, or two at once with SSE2, one by one for the rest.
+ *
+ * RETURN
+ *   The index of the matching tag plus 1
+ *   0 if none matches
+ */
+static inline unsigned int __match_tlb_tag(const uint64_t *tags, uint64_t tag,
+		unsigned int nr)
+{
+	unsigned int i = 0;
+
+#if defined(__AVX2__)
+	const __m256i key = _mm256_set1_epi64x(tag);
+
+	for (; i + 4 <= nr; i += 4) {
+		__m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(tags + i)), key);
+		int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+
+		if (mask) return i + __builtin_ctz(mask) + 1;
+	}
+#elif defined(__SSE2__)
+	const __m128i key = _mm_set1_epi64x(tag);
+
+	for (; i + 2 <= nr; i += 2) {
+		__m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(tags + i)), key);
+		int mask;
+
+		/* SSE2 compares 32-bit halves. A tag matches when both of its do */
+		eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+		mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+		if (mask) return i + __builtin_ctz(mask) + 1;
+	}
+#endif
+	for (; i < nr; i++) {
+		if (tags[i] == tag) return i + 1;
+	}
+	return 0;
+}
+
+
+/**
+ * __tlb_set(@cpu, @asid, @vpn)
+ *
+ * DESCRIPTION
+ *   Return the first entry of the set in the TLB of @cpu that @vpn of the
+ *   address space @asid can be cached in. The set is indexed by the low VPN
+ *   bits folded with the next higher bits so that consecutive VPNs as well
+ *   as VPNs apart by @config.tlb_sets are spread over different sets. The
+ *   ASID is also mixed in not to let the same VPNs of processes compete for
+ *   the same set.
+ */
+static inline struct tlb_entry *__tlb_set(struct cpu *cpu, unsigned int asid,
+		unsigned int vpn)
+{
+	unsigned int mask = vm->config.tlb_sets - 1;
+	unsigned int shift = __builtin_ctz(vm->config.tlb_sets);
+	unsigned int set = (vpn ^ (vpn >> shift) ^ (asid * 0x9e5)) & mask;
+
+	return cpu->tlb_entries + set * vm->config.tlb_ways;
+}
+
+
+/**
+ * __cpu_find_tlb(@cpu, @asid, @vpn, @huge)
+ *
+ * DESCRIPTION
+ *   Find the valid entry caching @vpn of @asid in the TLB of @cpu. With
+ *   @huge, find the entry caching the huge page containing @vpn instead.
+ *   Huge pages are indexed by their huge page numbers.
+ *
+ *   Only the tags of the set are compared, several at once where the
+ *   processor has vector instructions.
+ *
+ * RETURN
+ *   The TLB entry for @vpn, or NULL if @vpn is not cached in the TLB.
+ */
+static struct tlb_entry *__cpu_find_tlb(struct cpu *cpu, unsigned int asid,
+		unsigned int vpn, bool huge)
+{
+	struct tlb_entry *t;
+	unsigned int way;
+
+	if (huge) {
+		vpn &= ~(NR_PTES_PER_PAGE - 1);
+		t = __tlb_set(cpu, asid, vpn >> PTES_PER_PAGE_SHIFT);
+	} else {
+		t = __tlb_set(cpu, asid, vpn);
+	}
+	way = __match_tlb_tag(cpu->tlb_tags + (t - cpu->tlb_entries),
+			tlb_tag(asid, vpn, huge), vm->config.tlb_ways);
+	return way ? t + way - 1 : NULL;
+}
+
+
+/**
+ * __find_tlb(@vpn)
+ *
+ * DESCRIPTION
+ *   Find the valid TLB entry caching @vpn of the current process.
+ *
+ * RETURN
+ *   The TLB entry for @vpn, or NULL if @vpn is not cached in the TLB.
+ */
+static struct tlb_entry *__find_tlb(unsigned int vpn)
+{
+	return __cpu_find_tlb(vm->this_cpu, vm->this_cpu->curr->asid, vpn, false);
+}
+
+
+/**
+ * __find_huge_tlb(@vpn)
+ *
+ * DESCRIPTION
+ *   Find the valid TLB entry caching the huge page containing @vpn of the
+ *   current process.
+ *
+ * RETURN
+ *   The TLB entry for the huge page, or NULL if not cached in the TLB.
+ */
+static struct tlb_entry *__find_huge_tlb(unsigned int vpn)
+{
+	return __cpu_find_tlb(vm->this_cpu, vm->this_cpu->curr->asid, vpn, true);
+}
+
+
+/**
+ * __shootdown_tlb(@vpn, @huge)
+ *
+ * DESCRIPTION
+ *   Invalidate the entries for @vpn of the current process in the TLBs of
+ *   other CPUs that ran the process. With @huge, the entries for the huge
+ *   page containing @vpn are invalidated. The entry in the TLB of this CPU
+ *   should be updated by the caller. The IPIs to the CPUs are batched until
+ *   flush_tlb_shootdowns().
+ */
+static void __shootdown_tlb(unsigned int vpn, bool huge)
+{
+	unsigned long cpumask = vm->this_cpu->curr->cpumask & ~(1UL << vm->this_cpu->id);
+
+	if (!cpumask) return;
+
+	for (unsigned long mask = cpumask; mask; mask &= mask - 1) {
+		struct cpu *cpu = vm->cpus + __builtin_ctzl(mask);
+		struct tlb_entry *t = __cpu_find_tlb(cpu, vm->this_cpu->curr->asid, vpn, huge);
+
+		if (t) __invalidate_tlb_entry(cpu, t);
+	}
+	vm->mmu.tlb_batch.cpumask |= cpumask;
+	vm->mmu.tlb_batch.nr_entries++;
+}
+
+
+/**
+ * __shootdown_asid(@p)
+ *
+ * DESCRIPTION
+ *   Invalidate all entries of @p in the TLBs of other CPUs that ran the
+ *   process. Batched like __shootdown_tlb().
  */
-extern struct list_head processes;
+static void __shootdown_asid(struct process *p)
+{
+	unsigned long cpumask = p->cpumask & ~(1UL << vm->this_cpu->id);
+
+	if (!cpumask) return;
+
+	for (unsigned long mask = cpumask; mask; mask &= mask - 1) {
+		struct cpu *cpu = vm->cpus + __builtin_ctzl(mask);
+		struct tlb_entry *t = cpu->tlb_entries;
+
+		for (unsigned int i = 0; i < vm->config.tlb_sets * vm->config.tlb_ways; i++) {
+			if (t[i].asid == p->asid) __invalidate_tlb_entry(cpu, t + i);
+		}
+	}
+	vm->mmu.tlb_batch.cpumask |= cpumask;
+	vm->mmu.tlb_batch.nr_entries++;
+}
+
 
 /**
- * Currently running process
+ * flush_tlb_shootdowns()
+ *
+ * DESCRIPTION
+ *   Send the shootdowns batched during the operation. The framework calls
+ *   this function at the end of each operation.
  */
-extern struct process *current;
+void flush_tlb_shootdowns(void)
+{
+	if (!vm->mmu.tlb_batch.cpumask) return;
+
+	vm->stats.tlb_shootdowns++;
+	vm->stats.tlb_shootdown_ipis += __builtin_popcountl(vm->mmu.tlb_batch.cpumask);
+	vm->stats.tlb_shootdown_entries += vm->mmu.tlb_batch.nr_entries;
+
+	vm->mmu.tlb_batch.cpumask = 0;
+	vm->mmu.tlb_batch.nr_entries = 0;
+}
+
 
 /**
- * Page Table Base Register that MMU will walk through for address translation
+ * __flush_tlb()
+ *
+ * DESCRIPTION
+ *   Invalidate all TLB entries of all CPUs regardless of their ASIDs. Then
+ *   no CPU caches the mappings of processes other than its current one.
  */
-extern struct pagetable *ptbr;
+static void __flush_tlb(void)
+{
+	struct process *p;
+
+	for (unsigned int cpu = 0; cpu < vm->config.nr_cpus; cpu++) {
+		for (unsigned int i = 0; i < vm->config.tlb_sets * vm->config.tlb_ways; i++)
+			__invalidate_tlb_entry(vm->cpus + cpu, vm->cpus[cpu].tlb_entries + i);
+
+		if (vm->cpus[cpu].curr) vm->cpus[cpu].curr->cpumask = 1UL << cpu;
+		if (cpu != vm->this_cpu->id) vm->mmu.tlb_batch.cpumask |= 1UL << cpu;
+	}
+	list_for_each_entry(p, &vm->processes, list) {
+		p->cpumask = 0;
+	}
+	if (vm->mmu.tlb_batch.cpumask) vm->mmu.tlb_batch.nr_entries++;
+	charge_cycles(COST_TLB_FLUSH, 1);
+}
+
 
 /**
- * TLB of the system.
+ * __activate_asid(@p)
+ *
+ * DESCRIPTION
+ *   Make sure @p has an ASID of the current generation. If ASIDs of the
+ *   generation are used up, start a new generation after flushing TLB so
+ *   that no stale entry is tagged with a recycled ASID. The processes
+ *   running on the other CPUs go on filling their TLBs, so they get ASIDs of
+ *   the new generation first not to share them with the processes to come.
  */
-extern struct tlb_entry tlb[1UL << (PTES_PER_PAGE_SHIFT * 2)];
+static void __activate_asid(struct process *p)
+{
+	if (p->asid_generation == vm->mmu.asid_generation) return;
+
+	if (vm->mmu.next_asid == vm->config.nr_asids) {
+		__flush_tlb();
+		vm->mmu.asid_generation++;
+		vm->mmu.next_asid = 0;
+
+		for (unsigned int cpu = 0; cpu < vm->config.nr_cpus; cpu++) {
+			struct process *running = vm->cpus[cpu].curr;
+
+			if (!running || running == p) continue;
+			running->asid = vm->mmu.next_asid++;
+			running->asid_generation = vm->mmu.asid_generation;
+		}
+	}
+	p->asid = vm->mmu.next_asid++;
+	p->asid_generation = vm->mmu.asid_generation;
+}
 
 
 /**
- * The number of mappings for each page frame. Can be used to determine how
- * many processes are using the page frames.
+ * __tlb_victim(@set)
+ *
+ * DESCRIPTION
+ *   Choose the entry in @set to store a new translation. An invalid entry is
+ *   reused if any. Otherwise, evict an entry according to @config.tlb_policy.
  */
-extern unsigned int mapcounts[];
+static struct tlb_entry *__tlb_victim(struct tlb_entry *set)
+{
+	unsigned int ways = vm->config.tlb_ways;
+	unsigned int *hand;
+	struct tlb_entry *victim = set;
+
+	for (unsigned int i = 0; i < ways; i++) {
+		if (!set[i].valid) return set + i;
+	}
+
+	switch (vm->config.tlb_policy) {
+	case TLB_POLICY_FIFO:
+		for (unsigned int i = 1; i < ways; i++) {
+			if (set[i].seq < victim->seq) victim = set + i;
+		}
+		break;
+	case TLB_POLICY_LRU:
+		for (unsigned int i = 1; i < ways; i++) {
+			if (set[i].stamp < victim->stamp) victim = set + i;
+		}
+		break;
+	case TLB_POLICY_RANDOM:
+		/* xorshift32 */
+		vm->mmu.tlb_random ^= vm->mmu.tlb_random << 13;
+		vm->mmu.tlb_random ^= vm->mmu.tlb_random >> 17;
+		vm->mmu.tlb_random ^= vm->mmu.tlb_random << 5;
+		victim = set + vm->mmu.tlb_random % ways;
+		break;
+	case TLB_POLICY_CLOCK:
+		hand = vm->this_cpu->tlb_hands + (set - vm->this_cpu->tlb_entries) / ways;
+		while (set[*hand].referenced) {
+			set[*hand].referenced = false;
+			*hand = (*hand + 1) % ways;
+		}
+		victim = set + *hand;
+		*hand = (*hand + 1) % ways;
+		break;
+	default:
+		assert(!"Unknown TLB policy");
+	}
+	if (victim->prefetched) vm->stats.prefetch_wasted++;
+	return victim;
+}
 
 
 /**
@@ -63,22 +432,21 @@ extern unsigned int mapcounts[];
  *   Return true if the translation is cached in the TLB.
  *   Return false otherwise
  */
-
 bool lookup_tlb(unsigned int vpn, unsigned int rw, unsigned int *pfn)
 {
-	/*
-	for(int i = 0; i < 10; i++)
-		printf("%d%d%d ", tlb[i].valid, tlb[i].vpn, tlb[i].rw);
-	printf("\n");
-	*/
-	
-	for(int i = 0; i < NR_TLB_ENTRIES; i++){
-		if(tlb[i].vpn == vpn && tlb[i].rw & rw == rw && tlb[i].valid){
-			*pfn = tlb[i].pfn;
-			return true;
-		}
+	struct tlb_entry *t = __find_tlb(vpn);
+
+	if (!t && vm->mmu.nr_huge_mappings) t = __find_huge_tlb(vpn);
+	if (!t || (t->rw & rw) != rw) return false;
+
+	if (t->prefetched) {
+		t->prefetched = false;
+		vm->stats.prefetch_useful++;
 	}
-	return false;
+	t->stamp = ++vm->mmu.tlb_clock;
+	t->referenced = true;
+	*pfn = t->pfn + (t->huge ? vpn - t->vpn : 0);
+	return true;
 }
 
 
@@ -90,24 +458,1035 @@ bool lookup_tlb(unsigned int vpn, unsigned int rw, unsigned int *pfn)
  *   call this function when required, so no need to call this function manually.
  *   Note that if there exists an entry for @vpn already, just update it accordingly
  *   rather than removing it or creating a new entry.
- *   Also, in the current simulator, TLB is big enough to cache all the entries of
- *   the current page table, so don't worry about TLB entry eviction. ;-)
+ *   The mapping goes to the set indexed by @vpn. When all ways in the set are
+ *   in use, an entry is evicted according to @config.tlb_policy.
+ */
+void insert_tlb(unsigned int vpn, unsigned int rw, unsigned int pfn)
+{
+	struct tlb_entry *t = __find_tlb(vpn);
+
+	if (!t) {
+		t = __tlb_victim(__tlb_set(vm->this_cpu, vm->this_cpu->curr->asid, vpn));
+		__fill_tlb_entry(vm->this_cpu, t, vm->this_cpu->curr->asid, vpn, false);
+		t->seq = ++vm->mmu.tlb_seq;
+		t->prefetched = false;
+	}
+	t->rw = rw;
+	t->pfn = pfn;
+	t->stamp = ++vm->mmu.tlb_clock;
+	t->referenced = true;
+}
+
+
+/**
+ * prefetch_tlb(@vpn, @rw, @pfn)
+ *
+ * DESCRIPTION
+ *   Insert the mapping from @vpn to @pfn for @rw into the TLB ahead of any
+ *   access to @vpn. The entry is inserted as insert_tlb() does, but is not
+ *   referenced yet. Nothing is done if @vpn is in the TLB already.
+ */
+void prefetch_tlb(unsigned int vpn, unsigned int rw, unsigned int pfn)
+{
+	struct tlb_entry *t;
+
+	if (__find_tlb(vpn)) return;
+
+	t = __tlb_victim(__tlb_set(vm->this_cpu, vm->this_cpu->curr->asid, vpn));
+	__fill_tlb_entry(vm->this_cpu, t, vm->this_cpu->curr->asid, vpn, false);
+	t->seq = ++vm->mmu.tlb_seq;
+	t->rw = rw;
+	t->pfn = pfn;
+	t->stamp = ++vm->mmu.tlb_clock;
+	t->referenced = false;
+	t->prefetched = true;
+	vm->stats.tlb_prefetches++;
+}
+
+
+/**
+ * insert_huge_tlb(@vpn, @rw, @pfn)
+ *
+ * DESCRIPTION
+ *   Insert the mapping of the huge page containing @vpn into the TLB. @pfn
+ *   is the page frame that @vpn is translated to. Like insert_tlb(), the
+ *   existing entry for the huge page is updated if any.
+ */
+void insert_huge_tlb(unsigned int vpn, unsigned int rw, unsigned int pfn)
+{
+	struct cpu *cpu = vm->this_cpu;
+	unsigned int offset = vpn & (NR_PTES_PER_PAGE - 1);
+	struct tlb_entry *t = __find_huge_tlb(vpn);
+
+	if (!t) {
+		t = __tlb_victim(__tlb_set(cpu, cpu->curr->asid, vpn >> PTES_PER_PAGE_SHIFT));
+		__fill_tlb_entry(cpu, t, cpu->curr->asid, vpn - offset, true);
+		t->seq = ++vm->mmu.tlb_seq;
+		t->prefetched = false;
+	}
+	t->rw = rw;
+	t->pfn = pfn - offset;
+	t->stamp = ++vm->mmu.tlb_clock;
+	t->referenced = true;
+}
+
+
+/**
+ * lookup_pwc(@vpn, @rw)
+ *
+ * DESCRIPTION
+ *   Look up the page-walk cache of this CPU for the last-level directory of
+ *   @vpn of the current process. The framework calls this function on TLB
+ *   misses to skip the upper levels of the walk.
+ *
+ * RETURN
+ *   The PTE for @vpn in the cached directory, with @rw set to the permission
+ *   of the directories on the way
+ *   NULL if the directory is not cached
+ */
+struct pte *lookup_pwc(unsigned int vpn, unsigned int *rw)
+{
+	struct pwc_entry *e = vm->this_cpu->pwc_entries;
+	unsigned int tag = vpn >> PTES_PER_PAGE_SHIFT;
+
+	for (unsigned int i = 0; i < vm->config.nr_pwc_entries; i++) {
+		if (!e[i].valid || e[i].tag != tag) continue;
+
+		e[i].stamp = ++vm->mmu.pwc_clock;
+		*rw = e[i].rw;
+		return &e[i].dir->ptes[pt_index(vpn, vm->config.nr_pt_levels - 1)];
+	}
+	return NULL;
+}
+
+
+/**
+ * insert_pwc(@vpn, @dir, @rw)
+ *
+ * DESCRIPTION
+ *   Cache @dir as the last-level directory of @vpn of the current process,
+ *   reached with the permission @rw. The least recently used entry is
+ *   replaced when the cache is full.
+ */
+void insert_pwc(unsigned int vpn, struct pte_directory *dir, unsigned int rw)
+{
+	struct pwc_entry *e = vm->this_cpu->pwc_entries;
+	struct pwc_entry *victim = e;
+
+	for (unsigned int i = 0; i < vm->config.nr_pwc_entries; i++) {
+		if (!e[i].valid) {
+			victim = e + i;
+			break;
+		}
+		if (e[i].stamp < victim->stamp) victim = e + i;
+	}
+	victim->valid = true;
+	victim->tag = vpn >> PTES_PER_PAGE_SHIFT;
+	victim->dir = dir;
+	victim->rw = rw;
+	victim->stamp = ++vm->mmu.pwc_clock;
+}
+
+
+/**
+ * __flush_pwc(@cpu)
+ *
+ * DESCRIPTION
+ *   Invalidate all entries of the page-walk cache of @cpu. Called when the
+ *   page table of @cpu is switched, or its directories are copied on write.
+ */
+static void __flush_pwc(struct cpu *cpu)
+{
+	for (unsigned int i = 0; i < vm->config.nr_pwc_entries; i++)
+		cpu->pwc_entries[i].valid = false;
+}
+
+
+/**
+ * __invalidate_pwc(@dir)
+ *
+ * DESCRIPTION
+ *   Invalidate the entries for @dir in the page-walk cache of this CPU. Called
+ *   before @dir of the current process is freed.
+ */
+static void __invalidate_pwc(struct pte_directory *dir)
+{
+	struct pwc_entry *pwc = vm->this_cpu->pwc_entries;
+
+	for (unsigned int i = 0; i < vm->config.nr_pwc_entries; i++)
+		if (pwc[i].dir == dir) pwc[i].valid = false;
+}
+
+
+/**
+ * __get_frame(@pfn)
+ *
+ * DESCRIPTION
+ *   Increase the mapcount of @pfn for a new mapping to the allocated frame.
+ */
+static void __get_frame(unsigned int pfn)
+{
+	vm->mapcounts[pfn]++;
+}
+
+
+/**
+ * __put_frame(@pfn)
+ *
+ * DESCRIPTION
+ *   Decrease the mapcount of @pfn. Give the frame back to the buddy allocator
+ *   when the last mapping is gone.
+ */
+static void __put_frame(unsigned int pfn)
+{
+	if (--vm->mapcounts[pfn]) return;
+
+	buddy_free(&vm->frame_zones[frame_node(pfn)], pfn);
+}
+
+
+/**
+ * __put_slot(@slot)
+ *
+ * DESCRIPTION
+ *   Drop a reference to the swap @slot from a swapped PTE. The slot becomes
+ *   free when no PTE refers to it.
+ */
+static void __put_slot(unsigned int slot)
+{
+	if (--vm->swap.slot_counts[slot]) return;
+
+	clear_bit(slot, vm->swap.slot_map);
+}
+
+
+/**
+ * __rmap_head(@pte)
+ *
+ * DESCRIPTION
+ *   Return the list of the reverse mappings of the page referred by @pte,
+ *   which is of the swap slot if the page is swapped out.
+ */
+static inline struct list_head *__rmap_head(const struct pte *pte)
+{
+	return pte->swapped ? &vm->swap.slot_rmaps[pte->pfn] : &vm->frames[pte->pfn].rmap;
+}
+
+
+/**
+ * __rmap_add(@pte)
+ *
+ * DESCRIPTION
+ *   Add the reverse mapping to @pte into the page that @pte refers to.
+ */
+static void __rmap_add(struct pte *pte)
+{
+	struct rmap *r = pool_alloc(&vm->rmap_pool);
+
+	r->pte = pte;
+	list_add_tail(&r->list, __rmap_head(pte));
+}
+
+
+/**
+ * __rmap_del(@pte)
+ *
+ * DESCRIPTION
+ *   Remove the reverse mapping to @pte from the page that @pte refers to.
+ *   This should be called before @pte is changed to refer to another page.
+ */
+static void __rmap_del(struct pte *pte)
+{
+	struct rmap *r;
+
+	list_for_each_entry(r, __rmap_head(pte), list) {
+		if (r->pte != pte) continue;
+
+		list_del(&r->list);
+		pool_free(&vm->rmap_pool, r);
+		return;
+	}
+	assert(!"No reverse mapping to the PTE");
+}
+
+
+/**
+ * __alloc_directory()
+ *
+ * DESCRIPTION
+ *   Allocate a page directory with all entries invalid.
+ */
+static struct pte_directory *__alloc_directory(void)
+{
+	struct pte_directory *dir = pool_alloc(&vm->directory_pool);
+
+	memset(dir, 0x00, vm->directory_pool.size);
+	dir->refcount = 1;
+	vm->stats.directory_allocs++;
+	charge_cycles(COST_DIRECTORY, 1);
+	return dir;
+}
+
+
+/**
+ * __write_protect(@pte)
+ *
+ * DESCRIPTION
+ *   Make the page mapped by @pte read-only for copy-on-write. The original
+ *   permission is kept in @pte->private.
+ */
+static void __write_protect(struct pte *pte)
+{
+	if (!(pte->rw & ACCESS_WRITE)) return;
+
+	pte->private = pte->rw;
+	pte->rw = ACCESS_READ;
+}
+
+
+/**
+ * __unshare_directory(@entry, @level)
+ *
+ * DESCRIPTION
+ *   Make the directory of @level pointed by @entry private to the current
+ *   process so that its entries can be changed. If other processes still
+ *   share the directory, copy it. The entries in both copies now share
+ *   what they point to; the pages and the next-level directories get
+ *   referenced once more and are write-protected for copy-on-write.
+ */
+static void __unshare_directory(struct pte *entry, unsigned int level)
+{
+	struct pte_directory *dir = entry->dir;
+	struct pte_directory *copy;
+
+	//the permission and the directories cached for the walk change
+	__flush_pwc(vm->this_cpu);
+
+	entry->rw = ACCESS_READ | ACCESS_WRITE;
+	if (dir->refcount == 1) return;
+
+	copy = __alloc_directory();
+	copy->nr_valid = dir->nr_valid;
+	vm->stats.directory_copies++;
+
+	for (unsigned int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		struct pte *pte = &dir->ptes[i];
+
+		if (pte_none(pte)) continue;
+
+		if (pte->huge) {
+			__write_protect(pte);
+			for (unsigned int j = 0; j < NR_PTES_PER_PAGE; j++) {
+				__get_frame(pte->pfn + j);
+				vm->frames[pte->pfn + j].nr_huge_maps++;
+			}
+			vm->mmu.nr_huge_mappings++;
+		} else if (level + 1 < vm->config.nr_pt_levels) {
+			pte->rw &= ~ACCESS_WRITE;
+			pte->dir->refcount++;
+		} else if (pte->lazy) {
+			/* Nothing to share yet. Each copy is filled on its own */
+		} else {
+			__write_protect(pte);
+			if (pte->swapped) {
+				vm->swap.slot_counts[pte->pfn]++;
+			} else {
+				__get_frame(pte->pfn);
+			}
+		}
+		copy->ptes[i] = *pte;
+		if (pte->huge || (level + 1 == vm->config.nr_pt_levels && !pte->lazy)) {
+			__rmap_add(&copy->ptes[i]);
+		}
+	}
+
+	dir->refcount--;
+	entry->dir = copy;
+}
+
+
+/**
+ * __write_protect_tlb(@p)
+ *
+ * DESCRIPTION
+ *   Take the write permission away from the TLB entries of @p in this CPU,
+ *   and shoot down the entries of @p in the other CPUs. Used when the pages
+ *   of @p become shared for copy-on-write.
+ */
+static void __write_protect_tlb(struct process *p)
+{
+	struct tlb_entry *tlb = vm->this_cpu->tlb_entries;
+
+	if (p->asid_generation == vm->mmu.asid_generation) {
+		for (unsigned int i = 0; i < vm->config.tlb_sets * vm->config.tlb_ways; i++)
+			if (tlb[i].valid && tlb[i].asid == p->asid) tlb[i].rw &= ~ACCESS_WRITE;
+	}
+	__shootdown_asid(p);
+}
+
+
+/**
+ * __share_pagetable(@parent, @child)
+ *
+ * DESCRIPTION
+ *   Make @child share the page table of @parent for copy-on-write. The top
+ *   directory is referenced by both and write-protected, so that the first
+ *   change of either copies the directories on the way to it.
+ */
+static void __share_pagetable(struct process *parent, struct process *child)
+{
+	if (parent->pagetable.root.valid) {
+		parent->pagetable.root.rw = ACCESS_READ;
+		parent->pagetable.root.dir->refcount++;
+	}
+	child->pagetable.root = parent->pagetable.root;
+
+	//parent's pages are write-protected now
+	__write_protect_tlb(parent);
+}
+
+
+/**
+ * __end_borrow(@child)
+ *
+ * DESCRIPTION
+ *   Stop @child from borrowing the page table of its vfork parent. @child
+ *   shares the page table with the parent for copy-on-write from now on,
+ *   so the TLB entries and the page-walk cache that @child has filled with
+ *   the write permission of the parent are written off as well.
+ */
+static void __end_borrow(struct process *child)
+{
+	struct process *parent = child->lender;
+
+	__share_pagetable(parent, child);
+	__write_protect_tlb(child);
+	for (unsigned int i = 0; i < vm->config.nr_cpus; i++) {
+		if (vm->cpus[i].curr == child) __flush_pwc(vm->cpus + i);
+	}
+
+	child->lender = NULL;
+	parent->nr_borrowers--;
+	vm->stats.vfork_breaks++;
+}
+
+
+/**
+ * __populate(@vpn, @last_level)
+ *
+ * DESCRIPTION
+ *   Walk down the current page table for @vpn, and return the entry for @vpn
+ *   in the directory of @last_level. The directories on the way are
+ *   populated if they do not exist, and are made private to the current
+ *   process so that the entries can be changed.
+ */
+static struct pte *__populate(unsigned int vpn, unsigned int last_level)
+{
+	struct pte *pte;
+
+	//the page table borrowed after vfork is not to be changed
+	if (vm->this_cpu->curr->lender) __end_borrow(vm->this_cpu->curr);
+
+	pte = &vm->this_cpu->pt_base->root;
+
+	if (!pte->valid) {
+		pte->valid = true;
+		pte->rw = ACCESS_READ | ACCESS_WRITE;
+		pte->dir = __alloc_directory();
+	}
+
+	for (unsigned int level = 0; level <= last_level; level++) {
+		struct pte_directory *dir;
+
+		assert(!pte->huge);
+		if (!(pte->rw & ACCESS_WRITE) || pte->dir->refcount > 1) {
+			__unshare_directory(pte, level);
+		}
+
+		dir = pte->dir;
+		pte = &dir->ptes[pt_index(vpn, level)];
+		if (!pte_none(pte)) continue;
+
+		dir->nr_valid++;
+		pte->valid = true;
+		if (level < last_level) {
+			pte->rw = ACCESS_READ | ACCESS_WRITE;
+			pte->dir = __alloc_directory();
+		}
+	}
+	return pte;
+}
+
+
+/**
+ * __walk_pagetable(@pt, @vpn, @path)
+ *
+ * DESCRIPTION
+ *   Walk down @pt for @vpn, and record the entry looked up at each level
+ *   into @path starting from the root entry in @path[0]. Thus, @path[@level]
+ *   is the entry pointing to the directory of @level, and
+ *   @path[@config.nr_pt_levels] is the PTE for @vpn.
+ *
+ * RETURN
+ *   The number of entries recorded in @path. The walk stops at the first
+ *   invalid entry or at the huge page entry, so the walk reaches the PTE for
+ *   @vpn when it returns @config.nr_pt_levels + 1.
+ */
+static unsigned int __walk_pagetable(struct pagetable *pt, unsigned int vpn,
+		struct pte *path[])
+{
+	struct pte *pte = &pt->root;
+	unsigned int level;
+
+	for (level = 0; level < vm->config.nr_pt_levels; level++) {
+		path[level] = pte;
+		if (!pte->valid || pte->huge) return level + 1;
+		pte = &pte->dir->ptes[pt_index(vpn, level)];
+	}
+	path[level] = pte;
+	return level + 1;
+}
+
+
+/**
+ * __find_pte(@vpn)
+ *
+ * DESCRIPTION
+ *   Find the entry translating @vpn in the current page table.
+ *
+ * RETURN
+ *   The PTE for @vpn, or the huge page entry if @vpn is mapped with a huge
+ *   page. If some directory in the walk does not exist, the invalid entry
+ *   where the walk stops is returned.
+ */
+static struct pte *__find_pte(unsigned int vpn)
+{
+	struct pte *path[MAX_NR_PT_LEVELS + 1];
+
+	return path[__walk_pagetable(vm->this_cpu->pt_base, vpn, path) - 1];
+}
+
+
+/**
+ * __split_huge_page(@pmd, @vpn)
+ *
+ * DESCRIPTION
+ *   Split the huge page mapped by @pmd of the current process, which maps
+ *   @vpn, into NR_PTES_PER_PAGE PTEs having the same properties. The huge
+ *   page TLB entries are invalidated as well.
+ */
+static void __split_huge_page(struct pte *pmd, unsigned int vpn)
+{
+	struct pte_directory *dir = __alloc_directory();
+	struct tlb_entry *t = __find_huge_tlb(vpn);
+
+	__rmap_del(pmd);
+	for (unsigned int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		dir->ptes[i].valid = true;
+		dir->ptes[i].accessed = pmd->accessed;
+		dir->ptes[i].dirty = pmd->dirty;
+		dir->ptes[i].rw = pmd->rw;
+		dir->ptes[i].pfn = pmd->pfn + i;
+		dir->ptes[i].private = pmd->private;
+		vm->frames[pmd->pfn + i].nr_huge_maps--;
+		__rmap_add(&dir->ptes[i]);
+	}
+	dir->nr_valid = NR_PTES_PER_PAGE;
+
+	pmd->huge = false;
+	pmd->accessed = false;
+	pmd->dirty = false;
+	pmd->rw = ACCESS_READ | ACCESS_WRITE;
+	pmd->private = 0;
+	pmd->dir = dir;
+	vm->mmu.nr_huge_mappings--;
+
+	if (t) __invalidate_tlb_entry(vm->this_cpu, t);
+	__shootdown_tlb(vpn, true);
+}
+
+
+/**
+ * __map_page(@vpn, @rw, @pfn)
+ *
+ * DESCRIPTION
+ *   Map @vpn of the current process to @pfn for @rw. Directories on the way
+ *   are populated if they do not exist.
+ */
+static void __map_page(unsigned int vpn, unsigned int rw, unsigned int pfn)
+{
+	struct pte *pte = __populate(vpn, vm->config.nr_pt_levels - 1);
+
+	pte->rw = rw;
+	pte->pfn = pfn;
+	pte->private = 0;
+	__rmap_add(pte);
+}
+
+
+/**
+ * __bring_in(@pfn)
+ *
+ * DESCRIPTION
+ *   Stamp the frame @pfn that a page is just brought in for the page
+ *   replacement. The page is considered to be accessed now.
+ */
+static void __bring_in(unsigned int pfn)
+{
+	vm->frames[pfn].seq = ++vm->swap.seq;
+	vm->frames[pfn].stamp = vm->frame_clock;
+	vm->frames[pfn].referenced = true;
+}
+
+
+/**
+ * __evictable(@pfn, @pinned)
+ *
+ * DESCRIPTION
+ *   Check whether the page in @pfn can be evicted. Free frames, the frames of
+ *   huge pages, the zero frame, and the frame @pinned are not.
+ */
+static inline bool __evictable(unsigned int pfn, unsigned int pinned)
+{
+	return vm->mapcounts[pfn] && !vm->frames[pfn].nr_huge_maps && pfn != pinned &&
+		pfn != vm->zero_pfn;
+}
+
+
+/**
+ * __pick_victim(@pinned)
+ *
+ * DESCRIPTION
+ *   Choose the frame to evict according to @config.page_policy, except the
+ *   frame @pinned. CLOCK gives the frames referenced since the last round a
+ *   second chance. WS evicts the first frame out of the working set from the
+ *   clock hand, or the least recently used frame if all are in the set.
+ *
+ * RETURN
+ *   The page frame number of the victim
+ *   -1 if no frame can be evicted
+ */
+static int __pick_victim(unsigned int pinned)
+{
+	unsigned int nr_frames = vm->config.nr_pageframes;
+	unsigned int *hand = &vm->swap.hand;
+	int victim = -1;
+
+	switch (vm->config.page_policy) {
+	case PAGE_POLICY_FIFO:
+		for (unsigned int pfn = 0; pfn < nr_frames; pfn++) {
+			if (!__evictable(pfn, pinned)) continue;
+			if (victim < 0 || vm->frames[pfn].seq < vm->frames[victim].seq) victim = pfn;
+		}
+		break;
+	case PAGE_POLICY_LRU:
+		for (unsigned int pfn = 0; pfn < nr_frames; pfn++) {
+			if (!__evictable(pfn, pinned)) continue;
+			if (victim < 0 || vm->frames[pfn].stamp < vm->frames[victim].stamp) victim = pfn;
+		}
+		break;
+	case PAGE_POLICY_CLOCK:
+		/* All reference bits are cleared in the first round at worst */
+		for (unsigned int i = 0; i < nr_frames * 2; i++) {
+			unsigned int pfn = *hand;
+
+			*hand = (*hand + 1) % nr_frames;
+			if (!__evictable(pfn, pinned)) continue;
+			if (!vm->frames[pfn].referenced) return pfn;
+			vm->frames[pfn].referenced = false;
+		}
+		break;
+	case PAGE_POLICY_WS:
+		for (unsigned int i = 0; i < nr_frames; i++) {
+			unsigned int pfn = *hand;
+
+			*hand = (*hand + 1) % nr_frames;
+			if (!__evictable(pfn, pinned)) continue;
+			if (vm->frame_clock - vm->frames[pfn].stamp > vm->config.ws_window) return pfn;
+			if (victim < 0 || vm->frames[pfn].stamp < vm->frames[victim].stamp) victim = pfn;
+		}
+		break;
+	default:
+		assert(!"Unknown page replacement policy");
+	}
+	return victim;
+}
+
+
+/**
+ * __move_page(@swapped, @from, @to)
+ *
+ * DESCRIPTION
+ *   Move all the mappings of the page at @from to @to through the reverse
+ *   mappings of the page. With @swapped, the PTEs refer to the swap slot
+ *   @from, and are made to map the page frame @to. Otherwise, the PTEs map
+ *   the page frame @from, and are swapped out to the slot @to. The map
+ *   counts, slot counts, and the reverse mappings follow.
+ */
+static void __move_page(bool swapped, unsigned int from, unsigned int to)
+{
+	struct list_head *head = swapped ? &vm->swap.slot_rmaps[from] : &vm->frames[from].rmap;
+	struct rmap *r;
+
+	list_for_each_entry(r, head, list) {
+		struct pte *pte = r->pte;
+
+		pte->valid = swapped;
+		pte->swapped = !swapped;
+		pte->accessed = false;
+		pte->dirty = false;
+		pte->pfn = to;
+		if (swapped) {
+			__get_frame(to);
+			__put_slot(from);
+		} else {
+			vm->swap.slot_counts[to]++;
+			vm->mapcounts[from]--;
+		}
+	}
+	list_splice_init(head, swapped ? &vm->frames[to].rmap : &vm->swap.slot_rmaps[to]);
+}
+
+
+/**
+ * __invalidate_frame_tlb(@pfn)
+ *
+ * DESCRIPTION
+ *   Invalidate the TLB entries caching the page frame @pfn on all CPUs,
+ *   whatever processes they are for. The entries on other CPUs are shot down
+ *   in the batch.
+ */
+static void __invalidate_frame_tlb(unsigned int pfn)
+{
+	for (unsigned int cpu = 0; cpu < vm->config.nr_cpus; cpu++) {
+		struct tlb_entry *t = vm->cpus[cpu].tlb_entries;
+
+		for (unsigned int i = 0; i < vm->config.tlb_sets * vm->config.tlb_ways; i++) {
+			if (!t[i].valid || t[i].huge || t[i].pfn != pfn) continue;
+
+			__invalidate_tlb_entry(vm->cpus + cpu, t + i);
+			if (cpu == vm->this_cpu->id) continue;
+			vm->mmu.tlb_batch.cpumask |= 1UL << cpu;
+			vm->mmu.tlb_batch.nr_entries++;
+		}
+	}
+}
+
+
+/**
+ * __swap_out(@pfn)
+ *
+ * DESCRIPTION
+ *   Evict the page in @pfn to a free swap slot, and free the page frame.
+ *   All the PTEs mapping the page are swapped out to the same slot.
+ *
+ * RETURN
+ *   @true if the page is evicted
+ *   @false if the swap device is full
+ */
+static bool __swap_out(unsigned int pfn)
+{
+	unsigned int slot = find_first_zero_bit(vm->swap.slot_map, vm->config.nr_swap_slots);
+
+	if (slot == vm->config.nr_swap_slots) return false;
+	set_bit(slot, vm->swap.slot_map);
+
+	__move_page(false, pfn, slot);
+	__invalidate_frame_tlb(pfn);
+
+	assert(!vm->mapcounts[pfn]);
+	buddy_free(&vm->frame_zones[frame_node(pfn)], pfn);
+	vm->stats.swap_outs++;
+	return true;
+}
+
+
+/**
+ * __policy_node()
+ *
+ * DESCRIPTION
+ *   Choose the node to allocate page frames from for @current according to
+ *   its memory policy. INTERLEAVE moves on to the next node on each call.
+ */
+static unsigned int __policy_node(void)
+{
+	unsigned int node;
+
+	switch (vm->this_cpu->curr->mem_policy) {
+	case MEM_POLICY_LOCAL:
+		return vm->this_cpu->node;
+	case MEM_POLICY_INTERLEAVE:
+		node = vm->this_cpu->curr->next_node;
+		vm->this_cpu->curr->next_node = (node + 1) % vm->config.nr_nodes;
+		return node;
+	case MEM_POLICY_PREFERRED:
+		return vm->this_cpu->curr->preferred_node;
+	default:
+		assert(!"Unknown memory policy");
+	}
+	return 0;
+}
+
+
+/**
+ * __alloc_node_frames(@order, @node)
+ *
+ * DESCRIPTION
+ *   Allocate 2^@order contiguous page frames from @node, or from the nodes
+ *   after @node in order if @node has no free block of @order.
+ *
+ * RETURN
+ *   The first pfn of the allocated block
+ *   -1 if no node has a free block of @order
+ */
+static int __alloc_node_frames(unsigned int order, unsigned int node)
+{
+	for (unsigned int i = 0; i < vm->config.nr_nodes; i++) {
+		int pfn = buddy_alloc(&vm->frame_zones[(node + i) % vm->config.nr_nodes], order);
+
+		if (pfn < 0) continue;
+		if (i) vm->stats.node_fallbacks++;
+		return pfn;
+	}
+	return -1;
+}
+
+
+/**
+ * __alloc_frame(@pinned, @node)
+ *
+ * DESCRIPTION
+ *   Allocate a page frame with the smallest pfn in @node, falling back to
+ *   the other nodes. When no frame is free, evict a page to the swap device
+ *   to make one, but never the page in @pinned.
+ *
+ * RETURN
+ *   The page frame number of the allocated frame
+ *   -1 if no frame is available
+ */
+static int __alloc_frame(unsigned int pinned, unsigned int node)
+{
+	int pfn = __alloc_node_frames(0, node);
+	int victim;
+
+	if (pfn >= 0 || !vm->config.nr_swap_slots) return pfn;
+
+	victim = __pick_victim(pinned);
+	if (victim < 0 || !__swap_out(victim)) return -1;
+
+	return __alloc_node_frames(0, node);
+}
+
+
+/**
+ * __swap_in(@pte)
+ *
+ * DESCRIPTION
+ *   Read the page in the swap slot of @pte into a new page frame. All the
+ *   PTEs sharing the slot map the frame afterward, and the slot is freed.
+ *
+ * RETURN
+ *   @true if the page is read in
+ *   @false if no frame is available for the page
+ */
+static bool __swap_in(struct pte *pte)
+{
+	unsigned int slot = pte->pfn;
+	int pfn = __alloc_frame(-1U, __policy_node());
+
+	if (pfn < 0) return false;
+
+	__bring_in(pfn);
+	__move_page(true, slot, pfn);
+
+	assert(!test_bit(slot, vm->swap.slot_map));
+	vm->stats.swap_ins++;
+	return true;
+}
+
+
+/**
+ * lookup_swap(@vpn, @slot)
+ *
+ * DESCRIPTION
+ *   Check whether @vpn of the current process is swapped out, and set @slot
+ *   to the swap slot holding the page if so.
+ *
+ * RETURN
+ *   @true if @vpn is swapped out
+ *   @false otherwise
+ */
+bool lookup_swap(unsigned int vpn, unsigned int *slot)
+{
+	struct pte *pte = __find_pte(vpn);
+
+	if (!pte->swapped) return false;
+
+	*slot = pte->pfn;
+	return true;
+}
+
+
+/**
+ * __zero_frame()
+ *
+ * DESCRIPTION
+ *   Get the zero frame, allocating it on the first call.
+ *
+ * RETURN
+ *   The page frame number of the zero frame
+ *   -1 if no frame is available for it
+ */
+static int __zero_frame(void)
+{
+	int pfn;
+
+	if (vm->zero_pfn != -1U) return vm->zero_pfn;
+
+	pfn = __alloc_frame(-1U, __policy_node());
+	if (pfn < 0) return -1;
+
+	__bring_in(pfn);
+	__get_frame(pfn);
+	vm->zero_pfn = pfn;
+	return pfn;
+}
+
+
+/**
+ * __fill_lazy(@vpn, @rw)
+ *
+ * DESCRIPTION
+ *   Handle the first access for @rw to the lazily allocated page at @vpn. A
+ *   write assigns a new page frame to the page. A read maps the zero frame,
+ *   write-protected so that the first write comes back for a frame.
+ *
+ * RETURN
+ *   @true if the page is mapped
+ *   @false if no frame is available for the page
+ */
+static bool __fill_lazy(unsigned int vpn, unsigned int rw)
+{
+	struct pte *pte = __populate(vpn, vm->config.nr_pt_levels - 1);
+	int pfn = (rw & ACCESS_WRITE) ? __alloc_frame(-1U, __policy_node()) : __zero_frame();
+
+	if (pfn < 0) return false;
+
+	if (rw & ACCESS_WRITE) {
+		__bring_in(pfn);
+		vm->stats.zero_fills++;
+	} else {
+		vm->stats.zero_maps++;
+	}
+	__get_frame(pfn);
+	pte->valid = true;
+	pte->lazy = false;
+	pte->pfn = pfn;
+	__rmap_add(pte);
+	if (!(rw & ACCESS_WRITE)) __write_protect(pte);
+	return true;
+}
+
+
+/**
+ * reserve_page(@vpn, @rw)
+ *
+ * DESCRIPTION
+ *   Allocate @vpn to the current process for @rw without a page frame. The
+ *   page gets one on the first access to it in handle_page_fault().
+ */
+void reserve_page(unsigned int vpn, unsigned int rw)
+{
+	struct pte *pte = __populate(vpn, vm->config.nr_pt_levels - 1);
+
+	pte->valid = false;
+	pte->lazy = true;
+	pte->rw = rw;
+	pte->pfn = 0;
+	pte->private = 0;
+}
+
+
+/**
+ * lookup_lazy(@vpn)
+ *
+ * DESCRIPTION
+ *   Check whether @vpn of the current process is allocated lazily, and is
+ *   not accessed yet.
+ */
+bool lookup_lazy(unsigned int vpn)
+{
+	return __find_pte(vpn)->lazy;
+}
+
+
+/**
+ * alloc_pages(@vpn, @rw, @order)
+ *
+ * DESCRIPTION
+ *   Allocate 2^@order physically contiguous page frames from the buddy
+ *   allocator, and map them to the 2^@order consecutive VPNs from @vpn.
+ *   The block with the smallest pfn is allocated among the candidates in the
+ *   node of the memory policy of the current process. A single page frame
+ *   may be made by evicting a page to the swap device.
+ *
+ * RETURN
+ *   Return the first page frame number of the allocated frames.
+ *   Return -1 if no contiguous free frames are available.
+ */
+unsigned int alloc_pages(unsigned int vpn, unsigned int rw, unsigned int order)
+{
+	unsigned int node = __policy_node();
+	int pfn = order ? __alloc_node_frames(order, node) : __alloc_frame(-1U, node);
+
+	if (pfn < 0) return -1;
+
+	for (unsigned int i = 0; i < (1U << order); i++) {
+		__bring_in(pfn + i);
+		__get_frame(pfn + i);
+		__map_page(vpn + i, rw, pfn + i);
+	}
+	return pfn;
+}
+
+
+/**
+ * alloc_huge_page(@vpn, @rw)
+ *
+ * DESCRIPTION
+ *   Allocate NR_PTES_PER_PAGE contiguous page frames, and map them to the
+ *   VPNs from @vpn with a single entry in the level above the last level.
+ *   @vpn should be aligned to NR_PTES_PER_PAGE, and the VPNs should not be
+ *   mapped yet.
+ *
+ * RETURN
+ *   Return the first page frame number of the huge page.
+ *   Return -1 if no contiguous free frames are available.
  */
-void insert_tlb(unsigned int vpn, unsigned int rw, unsigned int pfn)
+unsigned int alloc_huge_page(unsigned int vpn, unsigned int rw)
 {
-	int target_tlb_idx = 0;
-	for(target_tlb_idx = 0; tlb[target_tlb_idx].valid; target_tlb_idx++);
-	for(int i = 0; i < NR_TLB_ENTRIES; i++){
-		if(tlb[i].valid && tlb[i].vpn == vpn){
-			target_tlb_idx = i;
-			break;
-		}
+	struct pte *pte;
+	int pfn;
+
+	assert(vm->config.nr_pt_levels >= 2);
+	assert(!(vpn & (NR_PTES_PER_PAGE - 1)));
+
+	pfn = __alloc_node_frames(PTES_PER_PAGE_SHIFT, __policy_node());
+	if (pfn < 0) return -1;
+
+	pte = __populate(vpn, vm->config.nr_pt_levels - 2);
+	pte->huge = true;
+	pte->rw = rw;
+	pte->pfn = pfn;
+	pte->private = 0;
+	__rmap_add(pte);
+	vm->mmu.nr_huge_mappings++;
+
+	for (unsigned int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		__get_frame(pfn + i);
+		vm->frames[pfn + i].nr_huge_maps++;
 	}
-	
-	tlb[target_tlb_idx].valid = true;
-	tlb[target_tlb_idx].vpn = vpn;
-	tlb[target_tlb_idx].rw = rw;
-	tlb[target_tlb_idx].pfn = pfn;
+	return pfn;
 }
 
 
@@ -129,32 +1508,53 @@ void insert_tlb(unsigned int vpn, unsigned int rw, unsigned int pfn)
  */
 unsigned int alloc_page(unsigned int vpn, unsigned int rw)
 {
-	int pfn = 0;
-	for(pfn = 0; pfn < NR_PAGEFRAMES; pfn++){
-		if(!mapcounts[pfn]) break;
+	return alloc_pages(vpn, rw, 0);
+}
+
+
+/**
+ * __unmap_page(@vpn)
+ *
+ * DESCRIPTION
+ *   Clear the PTE for @vpn of the current process, and give back what the
+ *   page holds. The directories that become empty are released. TLB entries
+ *   for @vpn itself are left to the caller.
+ */
+static void __unmap_page(unsigned int vpn)
+{
+	struct pte *path[MAX_NR_PT_LEVELS + 1];
+	unsigned int level = vm->config.nr_pt_levels;
+
+	//free a page out of the huge page
+	if (__find_pte(vpn)->huge) {
+		__split_huge_page(__populate(vpn, level - 2), vpn);
 	}
-	
-	if(pfn < NR_PAGEFRAMES){
-		mapcounts[pfn]++;
-		struct pte *target_pte = NULL;
-		int vpn1 = vpn >> PTES_PER_PAGE_SHIFT;
-		int vpn2 = vpn % (1 << PTES_PER_PAGE_SHIFT);
-		if(ptbr->outer_ptes[vpn1] == NULL){
-			ptbr->outer_ptes[vpn1] = (struct pte_directory *)malloc(sizeof(struct pte_directory));
-			for(int i = 0; i < NR_PTES_PER_PAGE; i++){
-				ptbr->outer_ptes[vpn1]->ptes[i].valid = false;
-			}
-			target_pte = &(ptbr->outer_ptes[vpn1]->ptes[vpn2]);
-		}else{
-			target_pte = &(ptbr->outer_ptes[vpn1]->ptes[vpn2]);
-		}
-		target_pte->valid = true;
-		target_pte->rw = rw;
-		target_pte->pfn = pfn;
-		target_pte->private = 0;
-		return pfn;
+	__populate(vpn, level - 1);
+	__walk_pagetable(vm->this_cpu->pt_base, vpn, path);
+	if (!path[level]->lazy) __rmap_del(path[level]);
+	if (path[level]->swapped) {
+		__put_slot(path[level]->pfn);
+	} else if (!path[level]->lazy) {
+		__put_frame(path[level]->pfn);
+	}
+
+	//modify pagetable. release the directories that become empty
+	path[level]->valid = false;
+	path[level]->swapped = false;
+	path[level]->lazy = false;
+	path[level]->accessed = false;
+	path[level]->dirty = false;
+	path[level]->rw = ACCESS_NONE;
+	path[level]->pfn = 0;
+	path[level]->private = 0;
+	while (level > 0 && --path[level - 1]->dir->nr_valid == 0) {
+		level--;
+		__invalidate_pwc(path[level]->dir);
+		pool_free(&vm->directory_pool, path[level]->dir);
+		vm->stats.directory_frees++;
+		path[level]->valid = false;
+		path[level]->dir = NULL;
 	}
-	else return -1;
 }
 
 
@@ -166,29 +1566,69 @@ unsigned int alloc_page(unsigned int vpn, unsigned int rw)
  *   for the corresponding PTE (valid, rw, pfn) is set @false or 0.
  *   Also, consider the case when a page is shared by two processes,
  *   and one process is about to free the page. Also, think about TLB as well ;-)
+ *   A swapped-out page gives its swap slot back instead of the page frame,
+ *   and a page allocated lazily has nothing to give back until accessed.
  */
 void free_page(unsigned int vpn)
 {
-	int vpn1 = vpn >> PTES_PER_PAGE_SHIFT;
-	int vpn2 = vpn % (1 << PTES_PER_PAGE_SHIFT);
-	struct pte *target_pte = &(ptbr->outer_ptes[vpn1]->ptes[vpn2]);
-	int pfn = target_pte->pfn;
-	mapcounts[pfn]--;
+	__unmap_page(vpn);
+
+	//modify tlb
+	struct tlb_entry *t = __find_tlb(vpn);
+	if(t) __invalidate_tlb_entry(vm->this_cpu, t);
+	__shootdown_tlb(vpn, false);
+}
+
+
+/**
+ * __invalidate_tlb_range(@cpu, @vpn, @nr, @stride)
+ *
+ * DESCRIPTION
+ *   Invalidate the entries of the current process in the TLB of @cpu for the
+ *   @nr VPNs from @vpn, @stride apart, in one pass over the TLB.
+ */
+static void __invalidate_tlb_range(struct cpu *cpu, unsigned int vpn,
+		unsigned int nr, unsigned int stride)
+{
+	struct tlb_entry *t = cpu->tlb_entries;
 
-	//modify pagetable
-	target_pte->valid = false;
-	bool is_ptes_empty = true;
-	for(int i = 0; i < NR_PTES_PER_PAGE; i++){
-		if(ptbr->outer_ptes[vpn1]->ptes[i].valid) is_ptes_empty = false;
+	for (unsigned int i = 0; i < vm->config.tlb_sets * vm->config.tlb_ways; i++) {
+		unsigned int offset = t[i].vpn - vpn;
+
+		if (!t[i].valid || t[i].huge || t[i].asid != vm->this_cpu->curr->asid) continue;
+		if (offset % stride || offset / stride >= nr) continue;
+
+		__invalidate_tlb_entry(cpu, t + i);
 	}
-	if(is_ptes_empty) free(ptbr->outer_ptes[vpn1]);
+}
 
-	//modify tlb
-	for(int i = 0; i < NR_TLB_ENTRIES; i++){
-		if(tlb[i].vpn == vpn && tlb[i].valid){
-			tlb[i].valid = false;
-		}
+
+/**
+ * free_range(@vpn, @nr, @stride)
+ *
+ * DESCRIPTION
+ *   Deallocate the pages at the @nr VPNs from @vpn, @stride apart, as
+ *   free_page() does for each of them. The VPNs that are not allocated are
+ *   skipped. The TLB entries for the range are invalidated together at the
+ *   end, with one pass over each TLB and a single shootdown request.
+ */
+void free_range(unsigned int vpn, unsigned int nr, unsigned int stride)
+{
+	unsigned long cpumask = vm->this_cpu->curr->cpumask & ~(1UL << vm->this_cpu->id);
+
+	for (unsigned int i = 0; i < nr; i++) {
+		if (pte_none(__find_pte(vpn + i * stride))) continue;
+		__unmap_page(vpn + i * stride);
 	}
+
+	__invalidate_tlb_range(vm->this_cpu, vpn, nr, stride);
+	if (!cpumask) return;
+
+	for (unsigned long mask = cpumask; mask; mask &= mask - 1) {
+		__invalidate_tlb_range(vm->cpus + __builtin_ctzl(mask), vpn, nr, stride);
+	}
+	vm->mmu.tlb_batch.cpumask |= cpumask;
+	vm->mmu.tlb_batch.nr_entries++;
 }
 
 
@@ -201,8 +1641,12 @@ void free_page(unsigned int vpn)
  *   0. page directory is invalid
  *   1. pte is invalid
  *   2. pte is not writable but @rw is for write
+ *   3. the page is swapped out
+ *   4. the page is allocated lazily, and is accessed for the first time
  *   This function should identify the situation, and do the copy-on-write if
- *   necessary.
+ *   necessary. A swapped-out page is read back, and the write-protection of
+ *   the page is resolved in the same fault. Writing to the zero frame makes
+ *   the page a new frame as copy-on-write does.
  *
  * RETURN
  *   @true on successful fault handling
@@ -210,36 +1654,246 @@ void free_page(unsigned int vpn)
  */
 bool handle_page_fault(unsigned int vpn, unsigned int rw)
 {
-	int vpn1 = vpn >> PTES_PER_PAGE_SHIFT;
-	int vpn2 = vpn % (1 << PTES_PER_PAGE_SHIFT);
+	struct pte *path[MAX_NR_PT_LEVELS + 1];
+	unsigned int depth = __walk_pagetable(vm->this_cpu->pt_base, vpn, path);
+	struct pte *pte = path[depth - 1];
+	bool major = false;
+
+	charge_cycles(COST_FAULT, 1);
 
-	if(!ptbr->outer_ptes[vpn1]){
+	if(!pte->valid && pte->swapped){
+		unsigned int perm = rw;
+
+		//read the page back from the swap device
+		if(!__swap_in(pte)) return false;
+		vm->stats.major_faults++;
+		major = true;
+
+		for(unsigned int i = 0; i < depth; i++) perm &= path[i]->rw;
+		if(perm == rw) return true;
+	} else if(!pte->valid && pte->lazy){
+		//the first access to the page allocated lazily
+		vm->stats.faults_invalid_pte++;
+		if(!(pte->rw & rw)) return false;
+		if(!__fill_lazy(vpn, rw)) return false;
+		vm->stats.minor_faults++;
 		return true;
-	}else if(!ptbr->outer_ptes[vpn1]->ptes[vpn2].valid){
+	} else if(!pte->valid){
+		if(depth <= vm->config.nr_pt_levels) vm->stats.faults_no_directory++;
+		else vm->stats.faults_invalid_pte++;
 		return true;
+	} else {
+		vm->stats.faults_write_protect++;
+	}
+
+	//the page is not writable at all
+	if(!((pte->rw | pte->private) & rw)){
+		return false;
+	}
+
+	//make the directories on the walk private; they may be shared after fork
+	pte = __populate(vpn, vm->config.nr_pt_levels - (pte->huge ? 2 : 1));
+
+	//write to a write-protected huge page
+	if(pte->huge && !(pte->rw & rw)){
+		bool shared = false;
+
+		for(unsigned int i = 0; i < NR_PTES_PER_PAGE; i++)
+			if(vm->mapcounts[pte->pfn + i] > 1) shared = true;
+
+		//no one else maps it. take it back as a whole
+		if(!shared){
+			struct tlb_entry *t = __find_huge_tlb(vpn);
+
+			pte->rw = pte->private;
+			pte->private = 0;
+			if(t) t->rw = pte->rw;
+			vm->stats.write_enables++;
+			if(!major) vm->stats.minor_faults++;
+			return true;
+		}
+
+		//copy only the page being written
+		__split_huge_page(pte, vpn);
+		vm->stats.huge_splits++;
+		pte = __find_pte(vpn);
 	}
 	
-	struct pte *pte = &ptbr->outer_ptes[vpn1]->ptes[vpn2];
-	if(!(pte->rw & rw) && pte->private & rw){
+	if(!pte->huge && !(pte->rw & rw)){
 		
+		struct tlb_entry *t = __find_tlb(vpn);
+
 		pte->rw = pte->private;
 		pte->private = 0;
 		
-		if(mapcounts[pte->pfn] > 1){
-			printf("copy on write\n");
-			mapcounts[pte->pfn]--;
-			int pfn = alloc_page(vpn, pte->rw);
-			for(int i = 0; i < NR_TLB_ENTRIES; i++)
-				if(tlb[i].valid && tlb[i].vpn == vpn)
-					tlb[i].pfn = pfn;
+		if(vm->mapcounts[pte->pfn] > 1){
+			//the page being copied should stay while making a frame for the copy,
+			//which goes to the node of the faulting cpu whatever the policy is
+			int pfn = __alloc_frame(pte->pfn, vm->this_cpu->node);
+
+			if(pfn < 0){
+				__write_protect(pte);
+				return false;
+			}
+			if(pte->pfn == vm->zero_pfn){
+				vm->stats.zero_fills++;
+			} else {
+				report("copy on write\n");
+				vm->stats.cow_copies++;
+				charge_cycles(COST_COW, 1);
+			}
+			__bring_in(pfn);
+			__get_frame(pfn);
+			__rmap_del(pte);
+			__put_frame(pte->pfn);
+			pte->pfn = pfn;
+			__rmap_add(pte);
+			if(t) t->pfn = pfn;
+			__shootdown_tlb(vpn, false);
+		} else {
+			vm->stats.write_enables++;
 		}
 
-		for(int i = 0; i < NR_TLB_ENTRIES; i++)
-			if(tlb[i].valid && tlb[i].vpn == vpn)
-				tlb[i].rw = rw;
-		return true;
+		if(t) t->rw = pte->rw;
+	}
+	if(!major) vm->stats.minor_faults++;
+	return true;
+}
+
+
+/**
+ * __find_process(@pid)
+ *
+ * DESCRIPTION
+ *   Look up the process with @pid in the ready queue through @pid_hash.
+ *
+ * RETURN
+ *   The process if it is in the ready queue
+ *   NULL otherwise
+ */
+static struct process *__find_process(unsigned int pid)
+{
+	struct process *p;
+
+	hlist_for_each_entry(p, &vm->pid_hash[pid_hashfn(pid)], hash) {
+		if (p->pid == pid) return p;
+	}
+	return NULL;
+}
+
+
+/**
+ * __hash_process(@p)
+ *
+ * DESCRIPTION
+ *   Hash @p into @pid_hash. @p is chained at the tail of the bucket, so the
+ *   processes of the same pid are found in the order of the ready queue.
+ */
+static void __hash_process(struct process *p)
+{
+	struct hlist_head *head = &vm->pid_hash[pid_hashfn(p->pid)];
+	struct hlist_node *last = head->first;
+
+	if (!last) {
+		hlist_add_head(&p->hash, head);
+		return;
+	}
+	while (last->next) last = last->next;
+	hlist_add_behind(&p->hash, last);
+}
+
+
+/**
+ * __new_process(@pid)
+ *
+ * DESCRIPTION
+ *   Allocate a process with @pid and an empty address space. The process
+ *   takes the memory policy of @current, or the default one on an idle CPU.
+ */
+static struct process *__new_process(unsigned int pid)
+{
+	struct process *p = pool_alloc(&vm->process_pool);
+
+	report("make new process\n");
+	p->pid = pid;
+	p->asid_generation = -1UL;
+	p->pagetable.root = (struct pte){ .valid = false };
+	p->lender = NULL;
+	p->nr_borrowers = 0;
+	p->nr_tlb_hits = 0;
+	p->nr_tlb_misses = 0;
+	p->wss = 0;
+	p->max_wss = 0;
+	p->wss_sum = 0;
+	p->nr_wss_samples = 0;
+	p->nr_local_accesses = 0;
+	p->nr_remote_accesses = 0;
+	memset(p->cycles, 0, sizeof(p->cycles));
+	p->nr_accesses = 0;
+	p->access_cycles = 0;
+	p->cpumask = 0;
+	INIT_LIST_HEAD(&p->list);
+	INIT_HLIST_NODE(&p->hash);
+
+	//the memory policy is inherited from the parent
+	if (vm->this_cpu->curr) {
+		p->mem_policy = vm->this_cpu->curr->mem_policy;
+		p->preferred_node = vm->this_cpu->curr->preferred_node;
+		p->next_node = vm->this_cpu->curr->next_node;
+	} else {
+		p->mem_policy = vm->config.mem_policy;
+		p->preferred_node = 0;
+		p->next_node = 0;
+	}
+	return p;
+}
+
+
+/**
+ * __end_borrowers(@parent)
+ *
+ * DESCRIPTION
+ *   Stop all the processes borrowing the page table of @parent, before
+ *   @parent runs again or is killed.
+ */
+static void __end_borrowers(struct process *parent)
+{
+	struct process *p;
+
+	for (unsigned int i = 0; i < vm->config.nr_cpus && parent->nr_borrowers; i++) {
+		if (vm->cpus[i].curr && vm->cpus[i].curr->lender == parent) __end_borrow(vm->cpus[i].curr);
+	}
+	list_for_each_entry(p, &vm->processes, list) {
+		if (!parent->nr_borrowers) break;
+		if (p->lender == parent) __end_borrow(p);
+	}
+}
+
+
+/**
+ * __switch_to(@next)
+ *
+ * DESCRIPTION
+ *   Put @current back to the ready queue, and run @next on this CPU.
+ */
+static void __switch_to(struct process *next)
+{
+	vm->stats.switches++;
+
+	//switch
+	//printf("switch\n");
+	if (next->nr_borrowers) __end_borrowers(next);
+	if(vm->this_cpu->curr){
+		list_add_tail(&vm->this_cpu->curr->list, &vm->processes);
+		__hash_process(vm->this_cpu->curr);
 	}
-	return false;
+	vm->this_cpu->curr = next;
+	vm->this_cpu->pt_base = &next->pagetable;
+	__flush_pwc(vm->this_cpu);
+	charge_cycles(COST_SWITCH, 1);
+
+	__activate_asid(vm->this_cpu->curr);
+	vm->this_cpu->curr->cpumask |= 1UL << vm->this_cpu->id;
 }
 
 
@@ -250,29 +1904,36 @@ bool handle_page_fault(unsigned int vpn, unsigned int rw)
  *   If there is a process with @pid in @processes, switch to the process.
  *   The @current process at the moment should be put into the @processes
  *   list, and @current should be replaced to the requested process.
+ *   The processes in @processes are also hashed in @pid_hash, so the next
+ *   process is found without walking through the list.
  *   Make sure that the next process is unlinked from the @processes, and
- *   @ptbr is set properly.
+ *   @ptbr is set properly. TLB entries are tagged with the ASID of their
+ *   processes, so TLB is not flushed unless ASIDs are recycled.
+ *
+ *   Each CPU has its own @current, and the processes running on other CPUs
+ *   are not in @processes. A process keeps the CPUs it has run on in its
+ *   @cpumask, so that the TLB entries of the process are shot down there.
  *
  *   If there is no process with @pid in the @processes list, fork a process
- *   from the @current. This implies the forked child process should have
+ *   from the @current. On an idle CPU, the new process starts with an empty
+ *   address space instead. This implies the forked child process should have
  *   the identical page table entry 'values' to its parent's (i.e., @current)
- *   page table. 
+ *   page table. The child shares the directories of the parent, and they
+ *   are copied on demand when either of them changes them.
  *   To implement the copy-on-write feature, you should manipulate the writable
  *   bit in PTE and mapcounts for shared pages. You may use pte->private for 
  *   storing some useful information :-)
  */
 void switch_process(unsigned int pid)
 {
-	struct process *next_process = NULL;
-	struct process *pos;
-	
+	struct process *next_process;
+
 	//find process
 	//printf("find process\n");
-	list_for_each_entry(pos, &processes, list){
-		if(pos->pid == pid){
-			next_process = pos;
-			break;
-		}
+	next_process = __find_process(pid);
+	if(next_process){
+		list_del_init(&next_process->list);
+		hlist_del_init(&next_process->hash);
 	}
 
 	//fork
@@ -280,51 +1941,330 @@ void switch_process(unsigned int pid)
 		
 		//printf("fork\n");
 		//make new process
-		printf("make new process\n");
-		next_process = (struct process *)malloc(sizeof(struct process));
-		next_process->pid = pid;
-		INIT_LIST_HEAD(&next_process->list);
+		next_process = __new_process(pid);
+
+		//an idle cpu starts the new process with an empty address space
+		if(!vm->this_cpu->curr){
+			vm->stats.forks++;
+			goto out_switch;
+		}
 
 		//copy pagetable
 		//printf("copy pagetable\n");
-		for(int i = 0; i < NR_PTES_PER_PAGE; i++){
-			if(current->pagetable.outer_ptes[i] == NULL)
-				next_process->pagetable.outer_ptes[i] = NULL;
-			else{
-				next_process->pagetable.outer_ptes[i] = (struct pte_directory *)malloc(sizeof(struct pte_directory));
-				for(int j = 0; j < NR_PTES_PER_PAGE; j++){
-					//modify rw and backup to private
-					if(current->pagetable.outer_ptes[i]->ptes[j].rw & ACCESS_WRITE){
-						current->pagetable.outer_ptes[i]->ptes[j].private = current->pagetable.outer_ptes[i]->ptes[j].rw;
-						current->pagetable.outer_ptes[i]->ptes[j].rw = ACCESS_READ;
-					}
-					next_process->pagetable.outer_ptes[i]->ptes[j] = current->pagetable.outer_ptes[i]->ptes[j];
-				}
+		if(vm->this_cpu->curr->lender) __end_borrow(vm->this_cpu->curr);
+		__share_pagetable(vm->this_cpu->curr, next_process);
+		vm->stats.forks++;
+	}
+
+out_switch:
+	__switch_to(next_process);
+}
+
+
+/**
+ * spawn_process(@pid)
+ *
+ * DESCRIPTION
+ *   Create a process with @pid and an empty address space as if it is just
+ *   exec'ed, and switch to it. Nothing of @current is shared or
+ *   write-protected for the new process.
+ */
+void spawn_process(unsigned int pid)
+{
+	__switch_to(__new_process(pid));
+	vm->stats.spawns++;
+}
+
+
+/**
+ * vfork_process(@pid)
+ *
+ * DESCRIPTION
+ *   Create a process with @pid that borrows the page table of @current, and
+ *   switch to it. The child runs on the directories of the parent as they
+ *   are, so the writes of the child go to the pages of the parent as vfork
+ *   does. The parent is not write-protected nor shot down.
+ *
+ *   The child keeps borrowing the page table until it changes the page table
+ *   for the first time, or until the parent runs again or is killed. Then
+ *   the child shares the page table with the parent for copy-on-write as if
+ *   it is forked at that moment. On an idle CPU, the process starts with an
+ *   empty address space like spawn_process().
+ */
+void vfork_process(unsigned int pid)
+{
+	struct process *child = __new_process(pid);
+
+	if (vm->this_cpu->curr) {
+		//borrow from the parent, not from whom the parent borrows
+		if (vm->this_cpu->curr->lender) __end_borrow(vm->this_cpu->curr);
+		child->pagetable.root = vm->this_cpu->curr->pagetable.root;
+		child->lender = vm->this_cpu->curr;
+		vm->this_cpu->curr->nr_borrowers++;
+	}
+	__switch_to(child);
+	vm->stats.vforks++;
+}
+
+
+/**
+ * __release_directory(@dir, @level)
+ *
+ * DESCRIPTION
+ *   Drop a reference to @dir of @level from the address space being torn
+ *   down. When no other process shares @dir anymore, release the pages, swap
+ *   slots, and directories under it as well as @dir itself.
+ */
+static void __release_directory(struct pte_directory *dir, unsigned int level)
+{
+	if (--dir->refcount) return;
+
+	for (unsigned int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		struct pte *pte = &dir->ptes[i];
+
+		if (pte_none(pte)) continue;
+
+		if (pte->huge) {
+			__rmap_del(pte);
+			for (unsigned int j = 0; j < NR_PTES_PER_PAGE; j++) {
+				vm->frames[pte->pfn + j].nr_huge_maps--;
+				__put_frame(pte->pfn + j);
+			}
+			vm->mmu.nr_huge_mappings--;
+		} else if (level + 1 < vm->config.nr_pt_levels) {
+			__release_directory(pte->dir, level + 1);
+		} else if (!pte->lazy) {
+			__rmap_del(pte);
+			if (pte->swapped) {
+				__put_slot(pte->pfn);
+			} else {
+				__put_frame(pte->pfn);
 			}
 		}
+	}
+	pool_free(&vm->directory_pool, dir);
+	vm->stats.directory_frees++;
+}
 
-		//modify mapcounts
-		//printf("modify mapcounts\n");
-		struct pagetable *pt = &next_process->pagetable;
-		for(int i = 0; i < NR_PTES_PER_PAGE; i++){
-			
-			if(!pt->outer_ptes[i]) continue;
-			
-			//printf("modify mapcounts in outer_ptes[%d]\n", i);
-			for(int j = 0; j < NR_PTES_PER_PAGE; j++){
-				if(pt->outer_ptes[i]->ptes[j].valid)
-					mapcounts[pt->outer_ptes[i]->ptes[j].pfn]++;
-			}
+
+/**
+ * kill_process(@pid)
+ *
+ * DESCRIPTION
+ *   Terminate the process with @pid, and release its whole address space.
+ *   The process is looked for as the current process of this CPU, in the
+ *   ready queue, and then as the current processes of the other CPUs. The
+ *   CPU that was running the process becomes idle.
+ *   All TLB entries of the process are invalidated at once, and those in the
+ *   other CPUs are shot down by the batch of the operation.
+ *
+ * RETURN
+ *   @true if the process is killed
+ *   @false if there is no process with @pid
+ */
+bool kill_process(unsigned int pid)
+{
+	struct process *p = NULL;
+	struct cpu *cpu = NULL;
+
+	if (vm->this_cpu->curr && vm->this_cpu->curr->pid == pid) {
+		cpu = vm->this_cpu;
+	} else if ((p = __find_process(pid))) {
+		list_del_init(&p->list);
+		hlist_del_init(&p->hash);
+	} else {
+		for (unsigned int i = 0; i < vm->config.nr_cpus && !cpu; i++) {
+			if (vm->cpus[i].curr && vm->cpus[i].curr->pid == pid) cpu = vm->cpus + i;
 		}
+		if (!cpu) return false;
 	}
 
-	//switch
-	//printf("switch\n");
-	list_add_tail(&current->list, &processes);
-	current = next_process;
-	ptbr = &next_process->pagetable;
+	if (cpu) {
+		p = cpu->curr;
+		cpu->curr = NULL;
+		cpu->pt_base = NULL;
+		__flush_pwc(cpu);
+	}
+	if (p->nr_borrowers) __end_borrowers(p);
+
+	if (p->cpumask & (1UL << vm->this_cpu->id)) {
+		struct tlb_entry *tlb = vm->this_cpu->tlb_entries;
+
+		for (unsigned int i = 0; i < vm->config.tlb_sets * vm->config.tlb_ways; i++)
+			if (tlb[i].valid && tlb[i].asid == p->asid) __invalidate_tlb_entry(vm->this_cpu, tlb + i);
+	}
+	__shootdown_asid(p);
+
+	//a borrowed page table is of the parent
+	if (p->lender) {
+		p->lender->nr_borrowers--;
+	} else if (p->pagetable.root.valid) {
+		__release_directory(p->pagetable.root.dir, 0);
+	}
+
+	//init is not from the pool
+	if (p != &vm->init) pool_free(&vm->process_pool, p);
+	vm->stats.exits++;
+	return true;
+}
+
+
+/**
+ * __migrate_frame(@from, @to)
+ *
+ * DESCRIPTION
+ *   Move the page in the page frame @from to the free frame @to in the same
+ *   node. The PTEs mapping the page are made to map @to through the reverse
+ *   mappings, and the TLB entries caching @from are invalidated on all CPUs.
+ */
+static void __migrate_frame(unsigned int from, unsigned int to)
+{
+	struct buddy_zone *zone = &vm->frame_zones[frame_node(from)];
+	struct rmap *r;
+	bool taken = buddy_take(zone, to);
+
+	assert(taken);
+	list_for_each_entry(r, &vm->frames[from].rmap, list) {
+		r->pte->pfn = to;
+	}
+	list_splice_init(&vm->frames[from].rmap, &vm->frames[to].rmap);
+
+	//the page keeps its age for the page replacement
+	vm->frames[to].seq = vm->frames[from].seq;
+	vm->frames[to].stamp = vm->frames[from].stamp;
+	vm->frames[to].referenced = vm->frames[from].referenced;
+	vm->mapcounts[to] = vm->mapcounts[from];
+	vm->mapcounts[from] = 0;
+
+	__invalidate_frame_tlb(from);
+	buddy_free(zone, from);
+	vm->stats.compact_migrations++;
+	charge_cycles(COST_MIGRATE, 1);
+}
+
+
+/**
+ * compact_frames()
+ *
+ * DESCRIPTION
+ *   Compact the page frames of each node by migrating the movable pages at
+ *   the top of the node to the free frames at the bottom of it, so that the
+ *   free frames come together at the top. Pages stay in their nodes. The
+ *   pages that could be evicted are movable; huge pages and the zero frame
+ *   stay where they are.
+ *
+ * RETURN
+ *   The number of pages migrated
+ */
+unsigned int compact_frames(void)
+{
+	unsigned int nr_migrated = 0;
+
+	for (unsigned int node = 0; node < vm->config.nr_nodes; node++) {
+		struct buddy_zone *zone = &vm->frame_zones[node];
+		unsigned int free = zone->base;
+		unsigned int top = zone->base + zone->nr_frames;
+
+		for (;;) {
+			while (free < top && test_bit(free - zone->base, zone->used_frames)) free++;
+			while (free < top && !__evictable(top - 1, -1U)) top--;
+			if (free >= top) break;
+
+			__migrate_frame(--top, free++);
+			nr_migrated++;
+		}
+	}
+	vm->stats.compactions++;
+	return nr_migrated;
+}
+
+
+/**
+ * __scan_directory(@dir, @level, @clear)
+ *
+ * DESCRIPTION
+ *   Count the pages accessed under @dir of @level, and clear their accessed
+ *   bits if @clear. A huge page counts as NR_PTES_PER_PAGE pages.
+ *
+ * RETURN
+ *   The number of the pages accessed
+ */
+static unsigned int __scan_directory(struct pte_directory *dir, unsigned int level,
+		bool clear)
+{
+	unsigned int nr_accessed = 0;
+
+	for (unsigned int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		struct pte *pte = &dir->ptes[i];
+
+		if (!pte->valid) continue;
+
+		if (!pte->huge && level + 1 < vm->config.nr_pt_levels) {
+			nr_accessed += __scan_directory(pte->dir, level + 1, clear);
+			continue;
+		}
+		if (!pte->accessed) continue;
+
+		nr_accessed += pte->huge ? NR_PTES_PER_PAGE : 1;
+		if (clear) pte->accessed = false;
+	}
+	return nr_accessed;
+}
+
+
+/**
+ * __sample_process(@p)
+ *
+ * DESCRIPTION
+ *   Take the pages that @p has accessed since the last sample as its working
+ *   set size.
+ *
+ * RETURN
+ *   The working set size of @p
+ */
+static unsigned int __sample_process(struct process *p)
+{
+	struct pte *root = &p->pagetable.root;
+
+	p->wss = root->valid ? __scan_directory(root->dir, 0, false) : 0;
+	if (p->wss > p->max_wss) p->max_wss = p->wss;
+	p->wss_sum += p->wss;
+	p->nr_wss_samples++;
+	return p->wss;
+}
+
+
+/**
+ * sample_working_sets()
+ *
+ * DESCRIPTION
+ *   Sample the working set sizes of all processes from the accessed bits of
+ *   their PTEs, and clear the bits to start the next interval. The framework
+ *   calls this function every @config.wss_interval memory accesses.
+ *   Processes sharing directories after fork share the accessed bits in
+ *   them, so the shared pages accessed by any of them count for all of them.
+ *   The bits are cleared after all processes are sampled for that reason.
+ */
+void sample_working_sets(void)
+{
+	unsigned long total = 0;
+	struct process *p;
+
+	for (unsigned int i = 0; i < vm->config.nr_cpus; i++) {
+		if (vm->cpus[i].curr) total += __sample_process(vm->cpus[i].curr);
+	}
+	list_for_each_entry(p, &vm->processes, list) {
+		total += __sample_process(p);
+	}
+
+	for (unsigned int i = 0; i < vm->config.nr_cpus; i++) {
+		p = vm->cpus[i].curr;
+		if (p && p->pagetable.root.valid) __scan_directory(p->pagetable.root.dir, 0, true);
+	}
+	list_for_each_entry(p, &vm->processes, list) {
+		if (p->pagetable.root.valid) __scan_directory(p->pagetable.root.dir, 0, true);
+	}
 
-	//flush tlb
-	for(int i = 0; i < NR_TLB_ENTRIES; i++)
-		tlb[i].valid = false;
+	vm->stats.wss_samples++;
+	if (total > vm->stats.peak_wss) vm->stats.peak_wss = total;
 }
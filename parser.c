@@ -22,31 +22,32 @@
 int parse_command(char *command, int *nr_tokens, char *tokens[])
 {
 	char *curr = command;
-	int token_started = false;
+	bool token_started = false;
 	*nr_tokens = 0;
 
-	while (*curr != '\0') {
-		if (isspace(*curr)) {
+	/* Lowercase, split, and strip the comment in a single pass */
+	for (; *curr != '\0'; curr++) {
+		unsigned char c = *curr;
+
+		if (isspace(c)) {
 			*curr = '\0';
 			token_started = false;
-		} else {
-			if (!token_started) {
-				tokens[*nr_tokens] = curr;
-				*nr_tokens += 1;
-				token_started = true;
+			continue;
+		}
+		if (!token_started) {
+			/* A token starting with # comments out the rest */
+			if (c == '#' || *nr_tokens == MAX_NR_TOKENS) {
+				*curr = '\0';
+				break;
 			}
+			tokens[*nr_tokens] = curr;
+			*nr_tokens += 1;
+			token_started = true;
 		}
-
-		curr++;
+		*curr = tolower(c);
 	}
 
-	for (int i = 0; i < *nr_tokens; i++) {
-		if (strncmp(tokens[i], "#", strlen("#")) == 0) {
-			*nr_tokens = i;
-			tokens[i] = NULL;
-			break;
-		}
-	}
+	if (*nr_tokens < MAX_NR_TOKENS) tokens[*nr_tokens] = NULL;
 
 	return (*nr_tokens > 0);
 }
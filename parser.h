@@ -39,6 +39,8 @@
  *    tokens[3] = "/path/to/dest"
  *    tokens[>=4] = NULL
  *
+ *  The tokens are made lowercase, and a token starting with '#' comments out
+ *  itself and the rest of @command. Up to MAX_NR_TOKENS tokens are parsed.
  *
  * RETURN VALUE
  *  Return 1 if @nr_tokens > 0
@@ -0,0 +1,98 @@
+/**********************************************************************
+ * Copyright (c) 2020-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "pool.h"
+
+void pool_init(struct pool *pool, const char *name, size_t size)
+{
+	memset(pool, 0x00, sizeof(*pool));
+
+	if (size < sizeof(void *)) size = sizeof(void *);
+	size = (size + CACHE_LINE_SIZE - 1) & ~((size_t)CACHE_LINE_SIZE - 1);
+
+	pool->name = name;
+	pool->size = size;
+	pool->objs_per_slab = size < SLAB_SIZE ? SLAB_SIZE / size : 1;
+}
+
+/**
+ * Carve a new slab, and put its objects into the free list
+ */
+static void __grow_pool(struct pool *pool)
+{
+	char *slab;
+
+	if (posix_memalign((void **)&slab, CACHE_LINE_SIZE,
+				pool->size * pool->objs_per_slab)) {
+		fprintf(stderr, "Unable to grow pool %s\n", pool->name);
+		abort();
+	}
+
+	if (pool->nr_slabs == pool->max_slabs) {
+		pool->max_slabs = pool->max_slabs ? pool->max_slabs * 2 : 16;
+		pool->slabs = realloc(pool->slabs, sizeof(*pool->slabs) * pool->max_slabs);
+	}
+	pool->slabs[pool->nr_slabs++] = slab;
+
+	/* Chain the objects so that they are handed out in the address order */
+	for (unsigned int i = pool->objs_per_slab; i > 0; i--) {
+		void **obj = (void **)(slab + pool->size * (i - 1));
+
+		*obj = pool->free_list;
+		pool->free_list = obj;
+	}
+}
+
+void *pool_alloc(struct pool *pool)
+{
+	void **obj;
+
+	if (!pool->free_list) __grow_pool(pool);
+
+	obj = pool->free_list;
+	pool->free_list = *obj;
+
+	pool->nr_allocs++;
+	if (++pool->nr_inuse > pool->max_inuse) pool->max_inuse = pool->nr_inuse;
+
+	return obj;
+}
+
+void pool_free(struct pool *pool, void *obj)
+{
+	*(void **)obj = pool->free_list;
+	pool->free_list = obj;
+
+	pool->nr_frees++;
+	pool->nr_inuse--;
+}
+
+void pool_destroy(struct pool *pool)
+{
+	for (unsigned int i = 0; i < pool->nr_slabs; i++) {
+		free(pool->slabs[i]);
+	}
+	free(pool->slabs);
+
+	pool->slabs = NULL;
+	pool->nr_slabs = pool->max_slabs = 0;
+	pool->free_list = NULL;
+	pool->nr_inuse = 0;
+}
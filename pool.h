@@ -0,0 +1,87 @@
+/**********************************************************************
+ * Copyright (c) 2020-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stddef.h>
+
+#define CACHE_LINE_SIZE	64
+
+/* Objects are carved from slabs of this size */
+#define SLAB_SIZE	(16 << 10)
+
+/**
+ * Pool of fixed-size objects
+ *
+ * Objects are carved out of cache-line-aligned slabs, and each object is
+ * rounded up to a multiple of CACHE_LINE_SIZE so that objects never straddle
+ * cache lines more than necessary. Freed objects are kept in @free_list,
+ * which is chained through the first word of the free objects, and are
+ * reused before carving a new slab. Slabs are released only when the pool
+ * is destroyed.
+ */
+struct pool {
+	const char *name;
+	size_t size;			/* Size of each object */
+	unsigned int objs_per_slab;
+
+	void *free_list;
+	void **slabs;
+	unsigned int nr_slabs;
+	unsigned int max_slabs;
+
+	/* Counters to show the pool usage */
+	unsigned long nr_inuse;
+	unsigned long max_inuse;
+	unsigned long nr_allocs;
+	unsigned long nr_frees;
+};
+
+/**
+ * pool_init(@pool, @name, @size)
+ *
+ * DESCRIPTION
+ *   Initialize @pool to allocate objects of @size bytes.
+ */
+void pool_init(struct pool *pool, const char *name, size_t size);
+
+/**
+ * pool_alloc(@pool)
+ *
+ * DESCRIPTION
+ *   Allocate an object from @pool. The content of the object is undefined.
+ *
+ * RETURN
+ *   The allocated object. Abort the program if the system runs out of memory.
+ */
+void *pool_alloc(struct pool *pool);
+
+/**
+ * pool_free(@pool, @obj)
+ *
+ * DESCRIPTION
+ *   Return @obj allocated from @pool back to @pool.
+ */
+void pool_free(struct pool *pool, void *obj);
+
+/**
+ * pool_destroy(@pool)
+ *
+ * DESCRIPTION
+ *   Release all slabs of @pool. All objects from @pool become invalid.
+ */
+void pool_destroy(struct pool *pool);
+
+#endif
@@ -0,0 +1,383 @@
+/**********************************************************************
+ * Copyright (c) 2020-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "list_head.h"
+#include "vm.h"
+#include "trace.h"
+
+static unsigned int __make_rwflag(const char *rw)
+{
+	unsigned int rwflag = ACCESS_READ;
+
+	for (; *rw; rw++) {
+		if (*rw == 'r' || *rw == 'R') {
+			rwflag |= ACCESS_READ;
+		}
+		if (*rw == 'w' || *rw == 'W') {
+			rwflag |= ACCESS_WRITE;
+		}
+	}
+	return rwflag;
+}
+
+/**
+ * Commands of text traces. @parse turns the command with its arguments into
+ * an operation, and returns @false if the arguments do not fit the command.
+ * @line is the command before being lowercased, from where @tokens[0] starts
+ * in it, for the arguments that keep their case.
+ */
+struct command {
+	const char *name;
+	enum vm_opcode opcode;
+	unsigned int rw;
+	bool (*parse)(const struct command *cmd, int nr_tokens,
+			char * const tokens[], const char *line, struct vm_op *op);
+};
+
+static bool __parse_noarg(const struct command *cmd, int nr_tokens,
+		char * const tokens[], const char *line, struct vm_op *op)
+{
+	if (nr_tokens != 1) return false;
+
+	op->opcode = cmd->opcode;
+	return true;
+}
+
+static bool __parse_tlb(const struct command *cmd, int nr_tokens,
+		char * const tokens[], const char *line, struct vm_op *op)
+{
+	if (nr_tokens == 1) {
+		op->opcode = OP_TLB;
+	} else if (nr_tokens == 2 && strcmp(tokens[1], "current") == 0) {
+		op->opcode = OP_TLB_CURRENT;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Turn @token into the VPNs of @op. @token is a VPN, or a range of VPNs in
+ * 'start-end' including both ends, optionally followed by '/stride'.
+ */
+static bool __parse_vpns(const char *token, struct vm_op *op)
+{
+	char *end;
+	uintmax_t start = strtoumax(token, &end, 0);
+	uintmax_t last = start, stride = 1;
+
+	if (end == token) return false;
+
+	if (*end == '-') {
+		token = end + 1;
+		last = strtoumax(token, &end, 0);
+		if (end == token) return false;
+
+		if (*end == '/') {
+			token = end + 1;
+			stride = strtoumax(token, &end, 0);
+			if (end == token) return false;
+		}
+	}
+	if (last > UINT32_MAX || last < start || !stride ||
+			(last - start) / stride >= UINT32_MAX) return false;
+
+	op->arg = start;
+	op->nr = (last - start) / stride + 1;
+	op->stride = stride;
+	return true;
+}
+
+/* switch, spawn, and vfork take one number */
+static bool __parse_number(const struct command *cmd, int nr_tokens,
+		char * const tokens[], const char *line, struct vm_op *op)
+{
+	if (nr_tokens != 2) return false;
+
+	op->opcode = cmd->opcode;
+	op->rw = cmd->rw;
+	op->arg = strtoimax(tokens[1], NULL, 0);
+	return true;
+}
+
+/* free, read, and write take VPNs */
+static bool __parse_range(const struct command *cmd, int nr_tokens,
+		char * const tokens[], const char *line, struct vm_op *op)
+{
+	if (nr_tokens != 2) return false;
+
+	op->opcode = cmd->opcode;
+	op->rw = cmd->rw;
+	return __parse_vpns(tokens[1], op);
+}
+
+static bool __parse_access(const struct command *cmd, int nr_tokens,
+		char * const tokens[], const char *line, struct vm_op *op)
+{
+	if (nr_tokens != 3) return false;
+
+	op->opcode = OP_ACCESS;
+	op->rw = __make_rwflag(tokens[2]);
+	return __parse_vpns(tokens[1], op);
+}
+
+static bool __parse_alloc(const struct command *cmd, int nr_tokens,
+		char * const tokens[], const char *line, struct vm_op *op)
+{
+	if (nr_tokens != 3 && nr_tokens != 4) return false;
+
+	if (!__parse_vpns(tokens[1], op)) return false;
+	op->rw = __make_rwflag(tokens[2]);
+
+	if (nr_tokens == 3) {
+		op->opcode = OP_ALLOC;
+	} else if (op->nr != 1) {
+		/* Multiple pages and huge pages are allocated from one VPN */
+		return false;
+	} else if (strcmp(tokens[3], "huge") == 0) {
+		op->opcode = OP_ALLOC_HUGE;
+	} else {
+		uintmax_t order = strtoimax(tokens[3], NULL, 0);
+
+		/* Too large orders are kept too large to be rejected later */
+		op->opcode = OP_ALLOC_PAGES;
+		op->order = order > UINT8_MAX ? UINT8_MAX : order;
+	}
+	return true;
+}
+
+/* exit and kill take an optional pid. exit without it ends the simulation */
+static bool __parse_kill(const struct command *cmd, int nr_tokens,
+		char * const tokens[], const char *line, struct vm_op *op)
+{
+	if (nr_tokens == 1) {
+		op->opcode = cmd->opcode;
+	} else if (nr_tokens == 2) {
+		op->opcode = OP_KILL;
+		op->arg = strtoimax(tokens[1], NULL, 0);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static const char * const mem_policy_names[NR_MEM_POLICIES] = {
+	[MEM_POLICY_LOCAL] = "local",
+	[MEM_POLICY_INTERLEAVE] = "interleave",
+	[MEM_POLICY_PREFERRED] = "preferred",
+};
+
+/* policy takes the name of a memory policy, and the node for preferred */
+static bool __parse_policy(const struct command *cmd, int nr_tokens,
+		char * const tokens[], const char *line, struct vm_op *op)
+{
+	unsigned int policy;
+
+	if (nr_tokens != 2 && nr_tokens != 3) return false;
+
+	for (policy = 0; policy < NR_MEM_POLICIES; policy++) {
+		if (strcmp(tokens[1], mem_policy_names[policy]) == 0) break;
+	}
+	if (policy == NR_MEM_POLICIES) return false;
+	if ((policy == MEM_POLICY_PREFERRED) != (nr_tokens == 3)) return false;
+
+	op->opcode = cmd->opcode;
+	op->arg = policy;
+	op->nr = nr_tokens == 3 ? strtoimax(tokens[2], NULL, 0) : 0;
+	return true;
+}
+
+/**
+ * Paths that checkpoint and restore name, in the order they are parsed. An
+ * operation refers to its path with the index into @paths.
+ */
+static char **paths = NULL;
+static unsigned int nr_paths = 0;
+
+static bool __parse_path(const struct command *cmd, int nr_tokens,
+		char * const tokens[], const char *line, struct vm_op *op)
+{
+	if (nr_tokens != 2) return false;
+
+	paths = realloc(paths, sizeof(*paths) * (nr_paths + 1));
+	paths[nr_paths] = strndup(line + (tokens[1] - tokens[0]), strlen(tokens[1]));
+
+	op->opcode = cmd->opcode;
+	op->arg = nr_paths++;
+	return true;
+}
+
+const char *trace_path(unsigned int index)
+{
+	return index < nr_paths ? paths[index] : NULL;
+}
+
+static const struct command commands[] = {
+	{ "exit",	OP_EXIT,	0,		__parse_kill },
+	{ "kill",	OP_KILL_CURRENT, 0,		__parse_kill },
+	{ "show",	OP_SHOW,	0,		__parse_noarg },
+	{ "frames",	OP_FRAMES,	0,		__parse_noarg },
+	{ "pools",	OP_POOLS,	0,		__parse_noarg },
+	{ "stats",	OP_STATS,	0,		__parse_noarg },
+	{ "compact",	OP_COMPACT,	0,		__parse_noarg },
+	{ "help",	OP_HELP,	0,		__parse_noarg },
+	{ "?",		OP_HELP,	0,		__parse_noarg },
+	{ "tlb",	OP_TLB,		0,		__parse_tlb },
+	{ "switch",	OP_SWITCH,	0,		__parse_number },
+	{ "s",		OP_SWITCH,	0,		__parse_number },
+	{ "spawn",	OP_SPAWN,	0,		__parse_number },
+	{ "vfork",	OP_VFORK,	0,		__parse_number },
+	{ "free",	OP_FREE,	0,		__parse_range },
+	{ "f",		OP_FREE,	0,		__parse_range },
+	{ "read",	OP_ACCESS,	ACCESS_READ,	__parse_range },
+	{ "r",		OP_ACCESS,	ACCESS_READ,	__parse_range },
+	{ "write",	OP_ACCESS,	ACCESS_WRITE,	__parse_range },
+	{ "w",		OP_ACCESS,	ACCESS_WRITE,	__parse_range },
+	{ "access",	OP_ACCESS,	0,		__parse_access },
+	{ "alloc",	OP_ALLOC,	0,		__parse_alloc },
+	{ "a",		OP_ALLOC,	0,		__parse_alloc },
+	{ "checkpoint",	OP_CHECKPOINT,	0,		__parse_path },
+	{ "restore",	OP_RESTORE,	0,		__parse_path },
+	{ "policy",	OP_POLICY,	0,		__parse_policy },
+};
+
+#define NR_COMMANDS	(sizeof(commands) / sizeof(commands[0]))
+
+/**
+ * Open-addressing hash table of @commands indexed by the hash of their names.
+ * It is more than twice as large as @commands, so a lookup mostly ends at
+ * the first slot.
+ */
+#define COMMAND_HASH_BITS	6
+#define NR_COMMAND_SLOTS	(1U << COMMAND_HASH_BITS)
+
+static const struct command *command_hash[NR_COMMAND_SLOTS];
+
+static unsigned int __hash_command(const char *name)
+{
+	unsigned int hash = 0;
+
+	for (; *name; name++) {
+		hash = hash * 31 + (unsigned char)*name;
+	}
+	return (hash * 0x9e370001U) >> (32 - COMMAND_HASH_BITS);
+}
+
+static void __init_command_hash(void)
+{
+	for (unsigned int i = 0; i < NR_COMMANDS; i++) {
+		unsigned int slot = __hash_command(commands[i].name);
+
+		while (command_hash[slot]) {
+			slot = (slot + 1) & (NR_COMMAND_SLOTS - 1);
+		}
+		command_hash[slot] = &commands[i];
+	}
+}
+
+static const struct command *__find_command(const char *name)
+{
+	unsigned int slot = __hash_command(name);
+
+	while (command_hash[slot]) {
+		if (strcmp(command_hash[slot]->name, name) == 0) {
+			return command_hash[slot];
+		}
+		slot = (slot + 1) & (NR_COMMAND_SLOTS - 1);
+	}
+	return NULL;
+}
+
+bool trace_parse(int nr_tokens, char * const tokens[], const char *line,
+		struct vm_op *op)
+{
+	static bool command_hash_initialized = false;
+	const struct command *cmd;
+
+	if (!command_hash_initialized) {
+		__init_command_hash();
+		command_hash_initialized = true;
+	}
+
+	*op = (struct vm_op) { .opcode = OP_NOP, .nr = 1, .stride = 1 };
+	line += strspn(line, " \t\n\v\f\r");
+
+	if (tokens[0][0] == '@') {
+		uintmax_t cpu = strtoimax(tokens[0] + 1, NULL, 0);
+
+		/* Too large CPU numbers are kept too large to be rejected later */
+		op->cpu = cpu > UINT8_MAX ? UINT8_MAX : cpu;
+		if (--nr_tokens == 0) return false;
+		line += tokens[1] - tokens[0];
+		tokens++;
+	}
+	assert(nr_tokens <= 4 && "Unknown command in trace");
+
+	cmd = __find_command(tokens[0]);
+	if (!cmd) return false;
+
+	return cmd->parse(cmd, nr_tokens, tokens, line, op);
+}
+
+const struct vm_op *trace_map(const char *path, size_t *nr_ops)
+{
+	int fd;
+	struct stat st;
+	struct trace_header *header;
+	void *map;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*header)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return NULL;
+
+	header = map;
+	if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) ||
+			header->version != TRACE_VERSION ||
+			st.st_size - sizeof(*header) != header->nr_ops * sizeof(struct vm_op)) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	/* Operations are replayed from the beginning to the end just once */
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	*nr_ops = header->nr_ops;
+	return (struct vm_op *)(header + 1);
+}
+
+void trace_unmap(const struct vm_op *ops, size_t nr_ops)
+{
+	struct trace_header *header = (struct trace_header *)ops - 1;
+
+	munmap(header, sizeof(*header) + nr_ops * sizeof(*ops));
+}
@@ -0,0 +1,130 @@
+/**********************************************************************
+ * Copyright (c) 2020-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "types.h"
+
+/**
+ * Operations of the simulator. Each command of text traces is turned into
+ * one of these before being simulated.
+ */
+enum vm_opcode {
+	OP_NOP = 0,
+	OP_ACCESS,		/* @arg: vpn, @rw: access type, @nr, @stride */
+	OP_ALLOC,		/* @arg: vpn, @rw: protection, @nr, @stride */
+	OP_ALLOC_PAGES,		/* @arg: vpn, @rw: protection, @order */
+	OP_ALLOC_HUGE,		/* @arg: vpn, @rw: protection */
+	OP_FREE,		/* @arg: vpn, @nr, @stride */
+	OP_SWITCH,		/* @arg: pid */
+	OP_SHOW,
+	OP_FRAMES,
+	OP_TLB,
+	OP_TLB_CURRENT,
+	OP_POOLS,
+	OP_HELP,
+	OP_EXIT,
+	OP_STATS,
+	OP_KILL,		/* @arg: pid */
+	OP_KILL_CURRENT,
+	OP_CHECKPOINT,		/* @arg: path, see trace_path() */
+	OP_RESTORE,		/* @arg: path */
+	OP_SPAWN,		/* @arg: pid */
+	OP_VFORK,		/* @arg: pid */
+	OP_POLICY,		/* @arg: memory policy, @nr: preferred node */
+	OP_COMPACT,
+	NR_OPCODES,
+};
+
+/**
+ * An operation in the fixed-width form. Binary traces are arrays of this
+ * stored in the host byte order. @cpu is the CPU to run the operation on,
+ * which is named with the '@cpu' prefix in text traces, or CPU 0 if not.
+ * The operations on VPNs apply to the @nr VPNs from @arg, @stride apart,
+ * which are given as 'start-end/stride' in text traces.
+ */
+struct vm_op {
+	uint8_t opcode;
+	uint8_t rw;
+	uint8_t cpu;
+	uint8_t order;
+	uint32_t arg;
+	uint32_t nr;
+	uint32_t stride;
+};
+
+/**
+ * Binary traces start with this header, followed by @nr_ops operations
+ */
+#define TRACE_MAGIC	"VMTR"
+#define TRACE_VERSION	3
+
+struct trace_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t nr_ops;
+};
+
+/**
+ * trace_parse(@nr_tokens, @tokens, @line, @op)
+ *
+ * DESCRIPTION
+ *   Turn the command in @tokens into @op. @tokens should be in lowercase, as
+ *   parse_command() splits them from @line. @line is the command as it was
+ *   before parse_command(), where the paths keep their case.
+ *   The command may be prefixed with '@cpu' to run it on the CPU.
+ *
+ * RETURN
+ *   @true if @tokens is a valid command
+ *   @false if the command is unknown
+ */
+bool trace_parse(int nr_tokens, char * const tokens[], const char *line,
+		struct vm_op *op);
+
+/**
+ * trace_path(@index)
+ *
+ * DESCRIPTION
+ *   Return the path that the operation parsed with @index as its @arg goes
+ *   to. Paths are kept by trace_parse() only, so binary traces cannot have
+ *   operations on paths.
+ */
+const char *trace_path(unsigned int index);
+
+/**
+ * trace_map(@path, @nr_ops)
+ *
+ * DESCRIPTION
+ *   Map the binary trace at @path into memory, and set @nr_ops to the number
+ *   of operations in it.
+ *
+ * RETURN
+ *   The operations in the trace
+ *   NULL if @path is not a binary trace
+ */
+const struct vm_op *trace_map(const char *path, size_t *nr_ops);
+
+/**
+ * trace_unmap(@ops, @nr_ops)
+ *
+ * DESCRIPTION
+ *   Unmap the binary trace mapped by trace_map().
+ */
+void trace_unmap(const struct vm_op *ops, size_t nr_ops);
+
+#endif
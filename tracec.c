@@ -0,0 +1,104 @@
+/**********************************************************************
+ * Copyright (c) 2020-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * Compile text traces into binary traces that the simulator replays
+ * without parsing them line by line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "parser.h"
+#include "trace.h"
+
+static bool __compile_trace(FILE *input, FILE *output)
+{
+	char command[MAX_COMMAND_LEN] = { 0 };
+	char line[MAX_COMMAND_LEN];
+	struct trace_header header = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.nr_ops = 0,
+	};
+	unsigned long lineno = 0;
+
+	/* Reserve the header, and fill it after counting the operations */
+	if (fwrite(&header, sizeof(header), 1, output) != 1) goto out_write;
+
+	while (fgets(command, sizeof(command), input)) {
+		char *tokens[MAX_NR_TOKENS] = { NULL };
+		int nr_tokens = 0;
+		struct vm_op op;
+
+		lineno++;
+
+		memcpy(line, command, sizeof(line));
+		if (!parse_command(command, &nr_tokens, tokens)) continue;
+
+		if (!trace_parse(nr_tokens, tokens, line, &op)) {
+			fprintf(stderr, "line %lu: Unknown command %s\n", lineno, tokens[0]);
+			return false;
+		}
+		if (op.opcode == OP_CHECKPOINT || op.opcode == OP_RESTORE) {
+			fprintf(stderr, "line %lu: checkpoint and restore need text traces\n", lineno);
+			return false;
+		}
+		if (fwrite(&op, sizeof(op), 1, output) != 1) goto out_write;
+		header.nr_ops++;
+	}
+
+	if (fseek(output, 0, SEEK_SET) ||
+			fwrite(&header, sizeof(header), 1, output) != 1) goto out_write;
+
+	return true;
+
+out_write:
+	perror("Unable to write the binary trace");
+	return false;
+}
+
+int main(int argc, char * argv[])
+{
+	FILE *input, *output;
+	bool ret;
+
+	if (argc != 3) {
+		printf("Usage: %s {text trace} {binary trace}\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	input = fopen(argv[1], "r");
+	if (!input) {
+		fprintf(stderr, "No input file %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	output = fopen(argv[2], "wb");
+	if (!output) {
+		fprintf(stderr, "Unable to create %s\n", argv[2]);
+		fclose(input);
+		return EXIT_FAILURE;
+	}
+
+	ret = __compile_trace(input, output);
+
+	fclose(input);
+	if (fclose(output)) ret = false;
+	if (!ret) remove(argv[2]);
+
+	return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
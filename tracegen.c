@@ -0,0 +1,272 @@
+/**********************************************************************
+ * Copyright (c) 2020-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * Generate synthetic text traces for the simulator.
+ *
+ * The trace allocates the working set of the initial process first, and
+ * then accesses it according to the distribution. Between accesses, it
+ * forks new processes and switches to existing ones at the given rates.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <strings.h>
+#include <math.h>
+
+#include "types.h"
+
+enum distribution {
+	DIST_SEQUENTIAL = 0,
+	DIST_UNIFORM,
+	DIST_ZIPF,
+	DIST_STRIDED,
+	NR_DISTRIBUTIONS,
+};
+
+static const char * const distribution_names[NR_DISTRIBUTIONS] = {
+	[DIST_SEQUENTIAL] = "sequential",
+	[DIST_UNIFORM] = "uniform",
+	[DIST_ZIPF] = "zipf",
+	[DIST_STRIDED] = "strided",
+};
+
+static struct {
+	unsigned long nr_ops;
+	unsigned int wss;		/* Working set size in pages */
+	enum distribution distribution;
+	double zipf_exponent;
+	unsigned int stride;
+	double write_ratio;		/* Fraction of accesses that are writes */
+	double fork_rate;		/* Probability to fork before an access */
+	double switch_rate;		/* Probability to switch before an access */
+	unsigned int max_processes;
+	uint64_t seed;
+} gen = {
+	.nr_ops = 100000,
+	.wss = 64,
+	.distribution = DIST_UNIFORM,
+	.zipf_exponent = 0.99,
+	.stride = 16,
+	.write_ratio = 0.3,
+	.fork_rate = 0.0,
+	.switch_rate = 0.0,
+	.max_processes = 64,
+	.seed = 1,
+};
+
+static uint64_t rand_state;
+
+/* xorshift64* */
+static uint64_t __rand(void)
+{
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return rand_state * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in [0, 1) */
+static double __rand_double(void)
+{
+	return (__rand() >> 11) * (1.0 / (1ULL << 53));
+}
+
+/* Cumulative distribution of the pages for Zipf */
+static double *zipf_cdf = NULL;
+
+static void __init_zipf(void)
+{
+	double sum = 0;
+
+	zipf_cdf = malloc(sizeof(*zipf_cdf) * gen.wss);
+	for (unsigned int i = 0; i < gen.wss; i++) {
+		sum += 1.0 / pow(i + 1, gen.zipf_exponent);
+		zipf_cdf[i] = sum;
+	}
+	for (unsigned int i = 0; i < gen.wss; i++) {
+		zipf_cdf[i] /= sum;
+	}
+}
+
+static unsigned int __next_zipf(void)
+{
+	double r = __rand_double();
+	unsigned int lo = 0, hi = gen.wss - 1;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (zipf_cdf[mid] < r) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static unsigned int __next_vpn(void)
+{
+	static unsigned long cursor = 0;
+	unsigned int vpn;
+
+	switch (gen.distribution) {
+	case DIST_SEQUENTIAL:
+		vpn = cursor++ % gen.wss;
+		break;
+	case DIST_ZIPF:
+		vpn = __next_zipf();
+		break;
+	case DIST_STRIDED:
+		/* Sweep the working set with the stride from every offset in turn */
+		vpn = (cursor * gen.stride + cursor * gen.stride / gen.wss) % gen.wss;
+		cursor++;
+		break;
+	case DIST_UNIFORM:
+	default:
+		vpn = __rand() % gen.wss;
+		break;
+	}
+	return vpn;
+}
+
+static void __generate(FILE *out)
+{
+	unsigned int nr_processes = 1;
+	unsigned int current = 0;
+	unsigned long nr_ops = 0;
+
+	for (unsigned int vpn = 0; vpn < gen.wss && nr_ops < gen.nr_ops; vpn++, nr_ops++) {
+		fprintf(out, "alloc %u rw\n", vpn);
+	}
+
+	for (; nr_ops < gen.nr_ops; nr_ops++) {
+		double r = __rand_double();
+
+		if (r < gen.fork_rate) {
+			if (nr_processes < gen.max_processes) {
+				current = nr_processes++;
+				fprintf(out, "switch %u\n", current);
+				continue;
+			}
+		} else if (r < gen.fork_rate + gen.switch_rate) {
+			/* Switching to the current pid would fork another process */
+			if (nr_processes > 1) {
+				unsigned int next = __rand() % (nr_processes - 1);
+
+				current = next >= current ? next + 1 : next;
+				fprintf(out, "switch %u\n", current);
+				continue;
+			}
+		}
+
+		fprintf(out, "%s %u\n",
+				__rand_double() < gen.write_ratio ? "write" : "read", __next_vpn());
+	}
+}
+
+static bool __parse_distribution(const char *name)
+{
+	for (int i = 0; i < NR_DISTRIBUTIONS; i++) {
+		if (strcasecmp(name, distribution_names[i]) == 0) {
+			gen.distribution = i;
+			return true;
+		}
+	}
+	fprintf(stderr, "Unknown distribution %s\n", name);
+	return false;
+}
+
+static void __print_usage(const char *name)
+{
+	printf("Usage: %s {options}\n", name);
+	printf("\n");
+	printf("  -n: Number of operations (default: %lu)\n", gen.nr_ops);
+	printf("  -w: Working set size in pages (default: %u)\n", gen.wss);
+	printf("  -d: Access distribution; sequential, uniform, zipf, or strided (default: %s)\n",
+			distribution_names[gen.distribution]);
+	printf("  -z: Exponent of the Zipf distribution (default: %.2f)\n", gen.zipf_exponent);
+	printf("  -k: Stride of the strided distribution in pages (default: %u)\n", gen.stride);
+	printf("  -r: Fraction of accesses that are writes (default: %.2f)\n", gen.write_ratio);
+	printf("  -f: Probability to fork a process before an access (default: %.2f)\n",
+			gen.fork_rate);
+	printf("  -s: Probability to switch to a process before an access (default: %.2f)\n",
+			gen.switch_rate);
+	printf("  -p: Maximum number of processes (default: %u)\n", gen.max_processes);
+	printf("  -x: Random seed (default: %" PRIu64 ")\n", gen.seed);
+	printf("\n");
+}
+
+int main(int argc, char * argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "hn:w:d:z:k:r:f:s:p:x:")) != -1) {
+		switch (opt) {
+		case 'n':
+			gen.nr_ops = strtoumax(optarg, NULL, 0);
+			break;
+		case 'w':
+			gen.wss = strtoumax(optarg, NULL, 0);
+			break;
+		case 'd':
+			if (!__parse_distribution(optarg)) return EXIT_FAILURE;
+			break;
+		case 'z':
+			gen.zipf_exponent = strtod(optarg, NULL);
+			break;
+		case 'k':
+			gen.stride = strtoumax(optarg, NULL, 0);
+			break;
+		case 'r':
+			gen.write_ratio = strtod(optarg, NULL);
+			break;
+		case 'f':
+			gen.fork_rate = strtod(optarg, NULL);
+			break;
+		case 's':
+			gen.switch_rate = strtod(optarg, NULL);
+			break;
+		case 'p':
+			gen.max_processes = strtoumax(optarg, NULL, 0);
+			break;
+		case 'x':
+			gen.seed = strtoumax(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			__print_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!gen.wss || !gen.stride || !gen.max_processes) {
+		fprintf(stderr, "Working set size, stride, and processes should be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	/* xorshift gets stuck at zero */
+	rand_state = gen.seed ? gen.seed : 1;
+	if (gen.distribution == DIST_ZIPF) __init_zipf();
+
+	__generate(stdout);
+
+	free(zipf_cdf);
+
+	return EXIT_SUCCESS;
+}
@@ -14,70 +14,285 @@
  **********************************************************************/
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <getopt.h>
-#include <ctype.h>
 #include <inttypes.h>
 #include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "types.h"
 #include "parser.h"
 
 #include "list_head.h"
+#include "bitmap.h"
+#include "buddy.h"
+#include "pool.h"
 #include "vm.h"
+#include "trace.h"
+#include "checkpoint.h"
 
 static bool verbose = true;
 
 static bool print_tlb_result = false;
 
+/* File to dump the statistics in JSON at exit */
+static const char *stats_file = NULL;
+
+/* Checkpoint to restore the system from before the simulation starts */
+static const char *restore_file = NULL;
+
 /**
- * Initial process
+ * The instance of the system that this thread simulates
  */
-static struct process init = {
-	.pid = 0,
-	.list = LIST_HEAD_INIT(init.list),
-	.pagetable = {
-		.outer_ptes = { NULL },
-	},
-};
+__thread struct vm_instance *vm = NULL;
 
 /**
- * Current process. Should not be listed in the @processes
+ * Simulator configuration from the command line options
  */
-struct process *current = &init;
+static struct vm_config options = {
+	.tlb_sets = 64,
+	.tlb_ways = 4,
+	.tlb_policy = TLB_POLICY_FIFO,
+	.nr_pwc_entries = 0,
+	.tlb_prefetch = TLB_PREFETCH_NONE,
+	.prefetch_degree = 4,
+	.nr_asids = NR_ASIDS,
+	.nr_pageframes = DEFAULT_NR_PAGEFRAMES,
+	.nr_pt_levels = DEFAULT_NR_PT_LEVELS,
+	.ptes_per_page_shift = DEFAULT_PTES_PER_PAGE_SHIFT,
+	.nr_cpus = 1,
+	.nr_nodes = 1,
+	.mem_policy = MEM_POLICY_LOCAL,
+	.nr_swap_slots = 0,
+	.page_policy = PAGE_POLICY_FIFO,
+	.ws_window = 1024,
+	.wss_interval = 0,
+	.compact_interval = 0,
+	.costs = {
+		[COST_TLB_HIT] = 1,
+		[COST_WALK] = 30,
+		[COST_FAULT] = 1500,
+		[COST_COW] = 3000,
+		[COST_DIRECTORY] = 600,
+		[COST_SWITCH] = 100,
+		[COST_TLB_FLUSH] = 300,
+		[COST_MIGRATE] = 2000,
+	},
+	.output_mode = OUTPUT_TEXT,
+};
+
+static const char * const tlb_policy_names[NR_TLB_POLICIES] = {
+	[TLB_POLICY_FIFO] = "fifo",
+	[TLB_POLICY_LRU] = "lru",
+	[TLB_POLICY_RANDOM] = "random",
+	[TLB_POLICY_CLOCK] = "clock",
+};
+
+static const char * const tlb_prefetch_names[NR_TLB_PREFETCHES] = {
+	[TLB_PREFETCH_NONE] = "none",
+	[TLB_PREFETCH_NEXT] = "next",
+	[TLB_PREFETCH_STRIDE] = "stride",
+};
+
+static const char * const page_policy_names[NR_PAGE_POLICIES] = {
+	[PAGE_POLICY_FIFO] = "fifo",
+	[PAGE_POLICY_CLOCK] = "clock",
+	[PAGE_POLICY_LRU] = "lru",
+	[PAGE_POLICY_WS] = "ws",
+};
+
+static const char * const mem_policy_names[NR_MEM_POLICIES] = {
+	[MEM_POLICY_LOCAL] = "local",
+	[MEM_POLICY_INTERLEAVE] = "interleave",
+	[MEM_POLICY_PREFERRED] = "preferred",
+};
+
+static const char * const cost_event_names[NR_COST_EVENTS] = {
+	[COST_TLB_HIT] = "tlb_hit",
+	[COST_WALK] = "walk",
+	[COST_FAULT] = "fault",
+	[COST_COW] = "cow",
+	[COST_DIRECTORY] = "directory",
+	[COST_SWITCH] = "switch",
+	[COST_TLB_FLUSH] = "tlb_flush",
+	[COST_MIGRATE] = "migrate",
+};
+
+static const char * const output_mode_names[NR_OUTPUT_MODES] = {
+	[OUTPUT_TEXT] = "text",
+	[OUTPUT_BUFFERED] = "buffered",
+	[OUTPUT_SUMMARY] = "summary",
+	[OUTPUT_NONE] = "none",
+};
+
+/* Size of the buffer for the results in the buffered output mode */
+#define OUTPUT_BUFFER_SIZE	(1UL << 20)
+
+/* Maximum number of worker threads to sweep configurations */
+#define MAX_SWEEP_THREADS	64
+
+/* Options of the system configuration that take no argument */
+#define FLAG_OPTIONS	"z"
+
+static const char * const op_names[NR_OPCODES] = {
+	[OP_NOP] = "nop",
+	[OP_ACCESS] = "access",
+	[OP_ALLOC] = "alloc",
+	[OP_ALLOC_PAGES] = "alloc pages",
+	[OP_ALLOC_HUGE] = "alloc huge",
+	[OP_FREE] = "free",
+	[OP_SWITCH] = "switch",
+	[OP_SHOW] = "show",
+	[OP_FRAMES] = "frames",
+	[OP_TLB] = "tlb",
+	[OP_TLB_CURRENT] = "tlb current",
+	[OP_POOLS] = "pools",
+	[OP_STATS] = "stats",
+	[OP_HELP] = "help",
+	[OP_EXIT] = "exit",
+	[OP_KILL] = "kill",
+	[OP_KILL_CURRENT] = "kill current",
+	[OP_CHECKPOINT] = "checkpoint",
+	[OP_RESTORE] = "restore",
+	[OP_SPAWN] = "spawn",
+	[OP_VFORK] = "vfork",
+	[OP_POLICY] = "policy",
+	[OP_COMPACT] = "compact",
+};
+
+extern unsigned int alloc_page(unsigned int vpn, unsigned int rw);
+extern unsigned int alloc_pages(unsigned int vpn, unsigned int rw, unsigned int order);
+extern unsigned int alloc_huge_page(unsigned int vpn, unsigned int rw);
+extern void free_page(unsigned int vpn);
+extern void free_range(unsigned int vpn, unsigned int nr, unsigned int stride);
+extern bool handle_page_fault(unsigned int vpn, unsigned int rw);
+extern void switch_process(unsigned int pid);
+extern void spawn_process(unsigned int pid);
+extern void vfork_process(unsigned int pid);
+extern bool kill_process(unsigned int pid);
+extern void flush_tlb_shootdowns(void);
+extern bool lookup_swap(unsigned int vpn, unsigned int *slot);
+extern void reserve_page(unsigned int vpn, unsigned int rw);
+extern bool lookup_lazy(unsigned int vpn);
+extern void sample_working_sets(void);
+extern unsigned int compact_frames(void);
+
+extern bool lookup_tlb(unsigned int vpn, unsigned int rw, unsigned int *pfn);
+extern void insert_tlb(unsigned int vpn, unsigned int rw, unsigned int pfn);
+extern void insert_huge_tlb(unsigned int vpn, unsigned int rw, unsigned int pfn);
+extern void prefetch_tlb(unsigned int vpn, unsigned int rw, unsigned int pfn);
+extern struct pte *lookup_pwc(unsigned int vpn, unsigned int *rw);
+extern void insert_pwc(unsigned int vpn, struct pte_directory *dir, unsigned int rw);
 
 /**
- * Ready queue. Put @current process to the tail of this list on
- * switch_process(). Don't forget to remove the switched process from the list.
+ * __track_stride(@vpn)
+ *
+ * DESCRIPTION
+ *   Track the distance between the VPNs accessed on this CPU for the STRIDE
+ *   prefetch policy.
  */
-LIST_HEAD(processes);
+static inline void __track_stride(unsigned int vpn)
+{
+	int stride = vpn - vm->this_cpu->last_vpn;
+
+	/* The retry after a page fault accesses the same VPN again */
+	if (!stride) return;
+
+	vm->this_cpu->prefetch_stride = stride == vm->this_cpu->last_stride ? stride : 0;
+	vm->this_cpu->last_stride = stride;
+	vm->this_cpu->last_vpn = vpn;
+}
 
 /**
- * Page table base register
+ * __prefetch_tlb(@vpn, @pte, @rw)
+ *
+ * DESCRIPTION
+ *   Prefetch translations into TLB on the miss for @vpn according to
+ *   @config.tlb_prefetch. @pte is the PTE for @vpn, and @rw is the permission
+ *   of the directories on the way to it. The valid PTEs next to @pte in the
+ *   same directory are prefetched, either following @pte or along the stride
+ *   that the accesses on this CPU have kept.
  */
-struct pagetable *ptbr = NULL;
+static void __prefetch_tlb(unsigned int vpn, struct pte *pte, unsigned int rw)
+{
+	int index = pt_index(vpn, vm->config.nr_pt_levels - 1);
+	int stride = 1;
+
+	if (vm->config.tlb_prefetch == TLB_PREFETCH_STRIDE) {
+		stride = vm->this_cpu->prefetch_stride;
+		if (!stride) return;
+	}
+
+	for (int i = 1; i <= vm->config.prefetch_degree; i++) {
+		int next = index + stride * i;
+
+		if (next < 0 || next >= NR_PTES_PER_PAGE) break;
+		if (!pte[next - index].valid) continue;
+
+		prefetch_tlb(vpn + stride * i, rw & pte[next - index].rw, pte[next - index].pfn);
+	}
+}
 
 /**
- * Map count for each page frame
+ * __lookup_pte(@vpn)
+ *
+ * DESCRIPTION
+ *   Find the PTE, or the huge page entry, that maps @vpn in the page table
+ *   of the current process. Unlike __translate(), the lookup is not an
+ *   access, so it leaves TLB, the accessed bits, and the counters alone.
+ *
+ * RETURN
+ *   The valid PTE for @vpn
+ *   NULL if @vpn is not mapped
  */
-unsigned int mapcounts[NR_PAGEFRAMES] = { 0 };
+static struct pte *__lookup_pte(unsigned int vpn)
+{
+	struct pte *pte = &vm->this_cpu->pt_base->root;
+
+	for (unsigned int level = 0; level < vm->config.nr_pt_levels && !pte->huge; level++) {
+		if (!pte->valid) return NULL;
+		pte = &pte->dir->ptes[pt_index(vpn, level)];
+	}
+	return pte->valid ? pte : NULL;
+}
 
 /**
- * TLB of the system
+ * __lookup_pfn(@vpn, @pfn)
+ *
+ * DESCRIPTION
+ *   Set @pfn to the page frame that @vpn is mapped to, without accessing it.
+ *
+ * RETURN
+ *   @true if @vpn is mapped to a page frame
+ *   @false otherwise
  */
-struct tlb_entry tlb[NR_TLB_ENTRIES] = {
-	{false, 0, 0},
-};
+static bool __lookup_pfn(unsigned int vpn, unsigned int *pfn)
+{
+	struct pte *pte = vm->this_cpu->pt_base ? __lookup_pte(vpn) : NULL;
 
-extern unsigned int alloc_page(unsigned int vpn, unsigned int rw);
-extern void free_page(unsigned int vpn);
-extern bool handle_page_fault(unsigned int vpn, unsigned int rw);
-extern void switch_process(unsigned int pid);
+	if (!pte) return false;
 
-extern bool lookup_tlb(unsigned int vpn, unsigned int rw, unsigned int *pfn);
-extern void insert_tlb(unsigned int vpn, unsigned int rw, unsigned int pfn);
+	*pfn = pte->pfn;
+	if (pte->huge) *pfn += vpn & (NR_PTES_PER_PAGE - 1);
+	return true;
+}
+
+/**
+ * __mark_pte(@pte, @rw)
+ *
+ * DESCRIPTION
+ *   Set the accessed bit of @pte, and the dirty bit as well for a write.
+ */
+static inline void __mark_pte(struct pte *pte, unsigned int rw)
+{
+	pte->accessed = true;
+	if (rw & ACCESS_WRITE) pte->dirty = true;
+}
 
 /**
  * __translate()
@@ -85,25 +300,39 @@ extern void insert_tlb(unsigned int vpn, unsigned int rw, unsigned int pfn);
  * DESCRIPTION
  *   This function simulates the address translation in MMU.
  *   It translates @vpn to @pfn using the page table pointed by @ptbr.
+ *   @from_tlb is set if TLB has the translation, and @nr_walked to the number
+ *   of directories read in the page walk otherwise, for the caller to charge
+ *   the access with.
  *
  * RETURN
  *   @true on successful translation
  *   @false if unable to translate. This includes the case when the page access
  *   is for write (indicated in @rw), but @pte->rw indicates it's read-only.
  */
-static bool __translate(unsigned int rw, unsigned int vpn, unsigned int *pfn, bool *from_tlb)
+static bool __translate(unsigned int rw, unsigned int vpn, unsigned int *pfn,
+		bool *from_tlb, unsigned int *nr_walked)
 {
-	int pd_index = vpn / NR_PTES_PER_PAGE;
-	int pte_index = vpn % NR_PTES_PER_PAGE;
-
-	struct pagetable *pt = ptbr;
-	struct pte_directory *pd;
+	struct pagetable *pt = vm->this_cpu->pt_base;
 	struct pte *pte;
+	unsigned int perm = ACCESS_READ | ACCESS_WRITE;
+	unsigned int level;
+	unsigned int dir_perm;
+	bool pwc = print_tlb_result && vm->config.nr_pwc_entries;
+
+	*nr_walked = 0;
 
 	/* Lookup the mapping from TLB */
-	if (print_tlb_result && lookup_tlb(vpn, rw, pfn)) {
-		*from_tlb = true;
-		return true;
+	if (print_tlb_result) {
+		if (vm->config.tlb_prefetch == TLB_PREFETCH_STRIDE) __track_stride(vpn);
+		if (lookup_tlb(vpn, rw, pfn)) {
+			vm->stats.tlb_hits++;
+			vm->this_cpu->curr->nr_tlb_hits++;
+			__mark_pte(__lookup_pte(vpn), rw);
+			*from_tlb = true;
+			return true;
+		}
+		vm->stats.tlb_misses++;
+		vm->this_cpu->curr->nr_tlb_misses++;
 	}
 
 	/* Nah, TLB miss */
@@ -112,30 +341,102 @@ static bool __translate(unsigned int rw, unsigned int vpn, unsigned int *pfn, bo
 	/* Page table is invalid */
 	if (!pt) return false;
 
-	pd = pt->outer_ptes[pd_index];
+	/* The walk starts from the last-level directory if it is cached */
+	if (pwc && (pte = lookup_pwc(vpn, &perm))) {
+		vm->stats.pwc_hits++;
+		vm->stats.walk_depths[1]++;
+		*nr_walked = 1;
+		goto walked;
+	}
+	if (pwc) vm->stats.pwc_misses++;
+
+	pte = &pt->root;
+	for (level = 0; level < vm->config.nr_pt_levels; level++) {
+		/* Page directory does not exist */
+		if (!pte->valid) break;
 
-	/* Page directory does not exist */
-	if (!pd) return false;
+		/* Writes are allowed only when all the directories are writable */
+		perm &= pte->rw;
+		if (pwc && level == vm->config.nr_pt_levels - 1) insert_pwc(vpn, pte->dir, perm);
+		pte = &pte->dir->ptes[pt_index(vpn, level)];
 
-	pte = &pd->ptes[pte_index];
+		/* Huge page is mapped without going down to the last level */
+		if (pte->huge) {
+			level++;
+			break;
+		}
+	}
+	vm->stats.walk_depths[level]++;
+	*nr_walked = level;
 
+walked:
 	/* PTE is invalid */
 	if (!pte->valid) return false;
 
 	/* Unable to handle the write access */
+	dir_perm = perm;
+	perm &= pte->rw;
 	if (rw & ACCESS_WRITE) {
-		if (!(pte->rw & ACCESS_WRITE)) return false;
+		if (!(perm & ACCESS_WRITE)) return false;
 	}
 	*pfn = pte->pfn;
+	if (pte->huge) *pfn += vpn & (NR_PTES_PER_PAGE - 1);
+	__mark_pte(pte, rw);
 
 	/* Insert the mapping into TLB */
 	if (print_tlb_result) {
-		insert_tlb(vpn, pte->rw, *pfn);
+		if (pte->huge) {
+			insert_huge_tlb(vpn, perm, *pfn);
+		} else {
+			insert_tlb(vpn, perm, *pfn);
+			if (vm->config.tlb_prefetch) __prefetch_tlb(vpn, pte, dir_perm);
+		}
 	}
 
 	return true;
 }
 
+/**
+ * __touch_frame(@pfn)
+ *
+ * DESCRIPTION
+ *   Mark the page frame @pfn accessed like MMU does for the page replacement.
+ */
+static inline void __touch_frame(unsigned int pfn)
+{
+	vm->frames[pfn].stamp = ++vm->frame_clock;
+	vm->frames[pfn].referenced = true;
+}
+
+/**
+ * __count_node_access(@pfn)
+ *
+ * DESCRIPTION
+ *   Count the memory access to @pfn as local if the frame is in the node of
+ *   this CPU, or as remote otherwise.
+ */
+static inline void __count_node_access(unsigned int pfn)
+{
+	if (frame_node(pfn) == vm->this_cpu->node) {
+		vm->this_cpu->curr->nr_local_accesses++;
+		vm->stats.local_accesses++;
+	} else {
+		vm->this_cpu->curr->nr_remote_accesses++;
+		vm->stats.remote_accesses++;
+	}
+}
+
+void report(const char *fmt, ...)
+{
+	va_list args;
+
+	if (vm->config.output_mode >= OUTPUT_SUMMARY) return;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
 /**
  * __access_memory
  *
@@ -157,21 +458,38 @@ static bool __access_memory(unsigned int vpn, unsigned int rw)
 	assert((rw & ACCESS_READ) ^ (rw & ACCESS_WRITE));
 
 	/**
-	 * We have NR_PTES_PER_PAGE entries in the outer table and so do for
-	 * inner page table. Thus each process can have up to NR_PTES_PER_PAGE^2
-	 * as its VPN
+	 * We have NR_PTES_PER_PAGE entries in each level of the page table.
+	 * Thus each process can have up to NR_PTES_PER_PAGE^levels as its VPN
 	 */
-	assert(vpn < NR_PTES_PER_PAGE * NR_PTES_PER_PAGE);
+	if (vpn >= NR_VPNS) {
+		report("Unable to access %u\n", vpn);
+		return false;
+	}
 
 	do {
 		bool from_tlb;
+		unsigned int nr_walked;
 		/* Ask MMU to translate VPN */
-		if (__translate(rw, vpn, &pfn, &from_tlb)) {
+		bool translated = __translate(rw, vpn, &pfn, &from_tlb, &nr_walked);
+
+		/* Only the accesses are charged for translations */
+		if (from_tlb) {
+			charge_cycles(COST_TLB_HIT, 1);
+		} else {
+			charge_cycles(COST_WALK, nr_walked);
+		}
+
+		if (translated) {
 			/* Success on address translation */
+			__touch_frame(pfn);
+			__count_node_access(pfn);
+			if (vm->config.wss_interval && !(vm->frame_clock % vm->config.wss_interval)) {
+				sample_working_sets();
+			}
 			if (print_tlb_result) {
-				fprintf(stderr, "%c |", from_tlb ? 'o' : 'x');
+				report("%c |", from_tlb ? 'o' : 'x');
 			}
-			fprintf(stderr, " %3u --> %-3u\n", vpn, pfn);
+			report(" %3u --> %-3u\n", vpn, pfn);
 			return true;
 		}
 
@@ -184,214 +502,1672 @@ static bool __access_memory(unsigned int vpn, unsigned int rw)
 	} while ((ret = handle_page_fault(vpn, rw)) == true && nr_retries < 2);
 
 	if (ret == false) {
-		fprintf(stderr, "Unable to access %u\n", vpn);
+		report("Unable to access %u\n", vpn);
 	}
 
 	return ret;
 }
 
-static unsigned int __make_rwflag(const char *rw)
+/**
+ * __access_range(@vpn, @nr, @stride, @rw)
+ *
+ * DESCRIPTION
+ *   Access the @nr VPNs from @vpn, @stride apart, in order. The accesses
+ *   go on even if some of them fail.
+ *
+ * RETURN
+ *   @true if all the accesses are successful
+ *   @false otherwise
+ */
+static bool __access_range(unsigned int vpn, unsigned int nr, unsigned int stride,
+		unsigned int rw)
 {
-	int len = strlen(rw);
-	unsigned int rwflag = ACCESS_READ;
+	bool ret = true;
 
-	for (int i = 0; i < len; i++) {
-		if (rw[i] == 'r' || rw[i] == 'R') {
-			rwflag |= ACCESS_READ;
-		}
-		if (rw[i] == 'w' || rw[i] == 'W') {
-			rwflag |= ACCESS_WRITE;
+	for (unsigned int i = 0; i < nr; i++) {
+		unsigned long cycles;
+
+		/**
+		 * Compact in the background before translating the access, so that
+		 * the access goes to the frame its page is in after the compaction.
+		 * The migrations are not counted in the time of the access.
+		 */
+		if (vm->config.compact_interval &&
+				!((vm->stats.memory_accesses + 1) % vm->config.compact_interval)) {
+			compact_frames();
 		}
+		cycles = vm->stats.cycles;
+
+		if (!__access_memory(vpn + i * stride, rw)) ret = false;
+
+		/* For the average memory access time */
+		cycles = vm->stats.cycles - cycles;
+		vm->this_cpu->curr->nr_accesses++;
+		vm->this_cpu->curr->access_cycles += cycles;
+		vm->stats.memory_accesses++;
+		vm->stats.access_cycles += cycles;
+	}
+	return ret;
+}
+
+/**
+ * __allocated(@vpn)
+ *
+ * DESCRIPTION
+ *   Check whether @vpn is allocated already, either to a page frame, to a
+ *   swap slot, or lazily, and report it if so.
+ */
+static bool __allocated(unsigned int vpn)
+{
+	unsigned int pfn;
+
+	if (__lookup_pfn(vpn, &pfn)) {
+		report("%u is already allocated to %u\n", vpn, pfn);
+		return true;
+	}
+	if (lookup_swap(vpn, &pfn)) {
+		report("%u is already allocated to swap %u\n", vpn, pfn);
+		return true;
+	}
+	if (lookup_lazy(vpn)) {
+		report("%u is already allocated (lazy)\n", vpn);
+		return true;
 	}
-	return rwflag;
+	return false;
 }
 
 static bool __alloc_page(unsigned int vpn, unsigned int rw)
 {
 	unsigned int pfn;
-	bool from_tlb;
 
 	assert(rw);
 	assert(rw & ACCESS_READ);
 
 	/* Check whether the requested VPN is already allocated */
-	if (__translate(ACCESS_READ, vpn, &pfn, &from_tlb)) {
-		fprintf(stderr, "%u is already allocated to %u\n", vpn, pfn);
-		return false;
+	if (__allocated(vpn)) return false;
+
+	if (vm->config.lazy_alloc) {
+		reserve_page(vpn, rw);
+		report("alloc %3u (lazy)\n", vpn);
+		return true;
 	}
 
 	pfn = alloc_page(vpn, rw);
 	if (pfn == -1) {
-		fprintf(stderr, "memory is full\n");
+		report("memory is full\n");
 		return false;
 	}
-	fprintf(stderr, "alloc %3u --> %-3u\n", vpn, pfn);
+	report("alloc %3u --> %-3u\n", vpn, pfn);
 	
 	return true;
 }
 
-static bool __free_page(unsigned int vpn)
+/* Allocate the VPNs of a range one by one, and stop at the first failure */
+static bool __alloc_range(unsigned int vpn, unsigned int nr, unsigned int stride,
+		unsigned int rw)
+{
+	for (unsigned int i = 0; i < nr; i++) {
+		if (!__alloc_page(vpn + i * stride, rw)) return false;
+	}
+	return true;
+}
+
+static bool __alloc_pages(unsigned int vpn, unsigned int rw, unsigned int order)
 {
 	unsigned int pfn;
-	bool from_tlb;
 
-	if (!__translate(ACCESS_READ, vpn, &pfn, &from_tlb)) {
-		fprintf(stderr, "%u is not allocated\n", vpn);
+	assert(rw & ACCESS_READ);
+
+	if (order >= MAX_ORDER ||
+			vpn + (1UL << order) > NR_VPNS) {
+		report("Unable to allocate 2^%u pages at %u\n", order, vpn);
+		return false;
+	}
+
+	for (unsigned int i = 0; i < (1U << order); i++) {
+		if (__allocated(vpn + i)) return false;
+	}
+
+	pfn = alloc_pages(vpn, rw, order);
+	if (pfn == -1) {
+		report("no contiguous 2^%u page frames\n", order);
 		return false;
 	}
-	fprintf(stderr, "free %u (pfn %u)\n", vpn, pfn);
-	free_page(vpn);
+	for (unsigned int i = 0; i < (1U << order); i++) {
+		report("alloc %3u --> %-3u\n", vpn + i, pfn + i);
+	}
 
 	return true;
 }
 
-static void __init_system(void)
+static bool __alloc_huge_page(unsigned int vpn, unsigned int rw)
 {
-	ptbr = &init.pagetable;
+	unsigned int pfn;
+
+	assert(rw & ACCESS_READ);
+
+	if (vm->config.nr_pt_levels < 2 || PTES_PER_PAGE_SHIFT >= MAX_ORDER ||
+			vpn & (NR_PTES_PER_PAGE - 1) || vpn >= NR_VPNS) {
+		report("Unable to allocate a huge page at %u\n", vpn);
+		return false;
+	}
+
+	for (unsigned int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		if (__allocated(vpn + i)) return false;
+	}
+
+	pfn = alloc_huge_page(vpn, rw);
+	if (pfn == -1) {
+		report("no contiguous %u page frames\n", NR_PTES_PER_PAGE);
+		return false;
+	}
+	report("alloc %3u --> %-3u (huge)\n", vpn, pfn);
+
+	return true;
 }
 
-static void __show_pageframes(void)
+/* Report what @vpn is freed from, or that it is not allocated */
+static bool __report_free(unsigned int vpn)
 {
-	for (unsigned int i = 0; i < NR_PAGEFRAMES; i++) {
-		if (!mapcounts[i]) continue;
-		fprintf(stderr, "%3u: %d\n", i, mapcounts[i]);
+	unsigned int pfn;
+
+	if (vpn >= NR_VPNS) {
+		report("%u is not allocated\n", vpn);
+		return false;
 	}
-	fprintf(stderr, "\n");
+	if (__lookup_pfn(vpn, &pfn)) {
+		report("free %u (pfn %u)\n", vpn, pfn);
+	} else if (lookup_swap(vpn, &pfn)) {
+		report("free %u (swap %u)\n", vpn, pfn);
+	} else if (lookup_lazy(vpn)) {
+		report("free %u (lazy)\n", vpn);
+	} else {
+		report("%u is not allocated\n", vpn);
+		return false;
+	}
+	return true;
 }
 
-static void __show_pagetable(void)
+/**
+ * __free_range(@vpn, @nr, @stride)
+ *
+ * DESCRIPTION
+ *   Free the @nr VPNs from @vpn, @stride apart. A range is freed in one
+ *   batch, skipping the VPNs that are not allocated, so that the TLBs are
+ *   invalidated once for the whole range.
+ *
+ * RETURN
+ *   @true if all the VPNs are allocated
+ *   @false otherwise
+ */
+static bool __free_range(unsigned int vpn, unsigned int nr, unsigned int stride)
 {
-	fprintf(stderr, "\n*** PID %u ***\n", current->pid);
+	bool ret = true;
+
+	if (nr == 1) {
+		if (!__report_free(vpn)) return false;
+		free_page(vpn);
+		return true;
+	}
+
+	for (unsigned int i = 0; i < nr; i++) {
+		if (!__report_free(vpn + i * stride)) ret = false;
+	}
+	free_range(vpn, nr, stride);
+
+	return ret;
+}
 
-	for (int i = 0; i < NR_PTES_PER_PAGE; i++) {
-		struct pte_directory *pd = current->pagetable.outer_ptes[i];
+/**
+ * __init_system(@cfg)
+ *
+ * DESCRIPTION
+ *   Create an instance of the system configured with @cfg, and make the
+ *   calling thread simulate it.
+ */
+static void __init_system(const struct vm_config *cfg)
+{
+	vm = calloc(1, sizeof(*vm));
+	if (!vm) {
+		fprintf(stderr, "Unable to create the system\n");
+		exit(EXIT_FAILURE);
+	}
+	vm->config = *cfg;
+
+	/* The initial process runs on CPU 0 with ASID 0 */
+	vm->init.cpumask = 1UL;
+	vm->init.mem_policy = vm->config.mem_policy;
+	INIT_LIST_HEAD(&vm->init.list);
+	for (unsigned int i = 0; i < vm->config.nr_cpus; i++) {
+		vm->cpus[i].id = i;
+		vm->cpus[i].node = i * vm->config.nr_nodes / vm->config.nr_cpus;
+	}
+	vm->cpus[0].curr = &vm->init;
+	vm->cpus[0].pt_base = &vm->init.pagetable;
+	vm->this_cpu = vm->cpus;
 
-		if (!pd) continue;
+	INIT_LIST_HEAD(&vm->processes);
 
-		for (int j = 0; j < NR_PTES_PER_PAGE; j++) {
-			struct pte *pte = &pd->ptes[j];
+	vm->mapcounts = calloc(vm->config.nr_pageframes, sizeof(*vm->mapcounts));
+	vm->frames = calloc(vm->config.nr_pageframes, sizeof(*vm->frames));
+	for (unsigned int i = 0; i < vm->config.nr_pageframes; i++) {
+		INIT_LIST_HEAD(&vm->frames[i].rmap);
+	}
+	for (unsigned int i = 0; i < vm->config.nr_nodes; i++) {
+		unsigned int nr_frames = vm->config.nr_pageframes / vm->config.nr_nodes;
 
-			if (!verbose && !pte->valid) continue;
-			fprintf(stderr, "%02d:%02d | %c %c%c | %-3d\n", i, j,
-				pte->valid ? 'v' : ' ',
-				pte->valid ? (pte->rw & ACCESS_READ ? 'r' : ' ') : ' ',
-				pte->rw & ACCESS_WRITE ? 'w' : ' ',
-				pte->pfn);
+		/* The last node takes the frames left over */
+		if (i == vm->config.nr_nodes - 1) {
+			nr_frames = vm->config.nr_pageframes - nr_frames * i;
 		}
-		printf("\n");
+		buddy_init(&vm->frame_zones[i], i * (vm->config.nr_pageframes / vm->config.nr_nodes), nr_frames);
 	}
+
+	vm->swap.slot_map = calloc(BITS_TO_LONGS(vm->config.nr_swap_slots) + 1, sizeof(unsigned long));
+	vm->swap.slot_counts = calloc(vm->config.nr_swap_slots + 1, sizeof(unsigned int));
+	vm->swap.slot_rmaps = calloc(vm->config.nr_swap_slots + 1, sizeof(struct list_head));
+	for (unsigned int i = 0; i < vm->config.nr_swap_slots; i++) {
+		INIT_LIST_HEAD(&vm->swap.slot_rmaps[i]);
+	}
+
+	pool_init(&vm->directory_pool, "directory",
+			sizeof(struct pte_directory) + sizeof(struct pte) * NR_PTES_PER_PAGE);
+	pool_init(&vm->process_pool, "process", sizeof(struct process));
+	pool_init(&vm->rmap_pool, "rmap", sizeof(struct rmap));
+
+	vm->mmu.tlb_random = 2463534242U;
+	vm->mmu.next_asid = 1;
+	vm->zero_pfn = -1U;
 }
 
-static void __show_tlb(void)
+/**
+ * __exit_system()
+ *
+ * DESCRIPTION
+ *   Release the instance that the calling thread simulates. The directories
+ *   and processes go away together with their pools.
+ */
+static void __exit_system(void)
 {
-	for (int i = 0; i < sizeof(tlb) / sizeof(*tlb); i++) {
-		struct tlb_entry *t = tlb + i;
+	pool_destroy(&vm->rmap_pool);
+	pool_destroy(&vm->process_pool);
+	pool_destroy(&vm->directory_pool);
+	for (unsigned int i = 0; i < vm->config.nr_nodes; i++) {
+		buddy_destroy(&vm->frame_zones[i]);
+	}
+	free(vm->swap.slot_map);
+	free(vm->swap.slot_counts);
+	free(vm->swap.slot_rmaps);
+	free(vm->frames);
+	free(vm->mapcounts);
+
+	free(vm);
+	vm = NULL;
+}
 
-		if (!t->valid) continue;
+/**
+ * __restore_system(@path)
+ *
+ * DESCRIPTION
+ *   Replace the system with the one saved in the checkpoint at @path. The
+ *   checkpoint is restored into a new instance configured the same as the
+ *   current one, so the current system remains intact if it fails.
+ *
+ * RETURN
+ *   @true if the system is restored
+ *   @false otherwise
+ */
+static bool __restore_system(const char *path)
+{
+	struct vm_instance *prev = vm, *next;
+	const struct vm_config cfg = vm->config;
 
-		fprintf(stderr, "%c%c | %3d -> %-3d\n",
-				t->rw & ACCESS_READ ? 'r' : ' ',
-				t->rw & ACCESS_WRITE ? 'w' : ' ',
-				t->vpn, t->pfn);
+	__init_system(&cfg);
+	if (!checkpoint_restore(path)) {
+		__exit_system();
+		vm = prev;
+		return false;
 	}
+	next = vm;
+	vm = prev;
+	__exit_system();
+	vm = next;
+
+	return true;
 }
 
-static void __print_help(void)
+static bool __checkpoint(const char *path)
 {
-	printf("  help | ?     : Print out this help message \n");
-	printf("  exit         : Exit the simulation\n");
-	printf("\n");
-	printf("  switch [pid] : Do context switch to pid @pid\n");
-	printf("                 Fork @pid if there is no process with the pid\n");
-	printf("  show         : Show the page table of the current process\n");
-	printf("  frames       : Show the status for each page frame\n");
-	printf("  tlb          : Show TLB entries\n");
-	printf("\n");
-	printf("  alloc [vpn] r|w  : Allocate a page according to the rw flag\n");
-	printf("  free [vpn]       : Deallocate the page at VPN @vpn\n");
-	printf("  access [vpn] r|w : Access VPN @vpn for read or write\n");
-	printf("  read [vpn]       : Equivalent to access @vpn r\n");
-	printf("  write [vpn]      : Equivalent to access @vpn w\n");
-	printf("\n");
+	if (!checkpoint_save(path)) return false;
+	report("checkpoint %s\n", path);
+
+	return true;
 }
 
-static bool strmatch(char * const str, const char *expect)
+static bool __restore(const char *path)
 {
-	return (strlen(str) == strlen(expect)) &&
-			(strncmp(str, expect, strlen(expect)) == 0);
+	if (!__restore_system(path)) return false;
+	report("restore %s\n", path);
+
+	return true;
 }
 
-static void __do_simulation(FILE *input)
+static void __show_pools(void)
 {
-	char command[MAX_COMMAND_LEN] = { 0 };
+	struct pool *pools[] = { &vm->directory_pool, &vm->process_pool, &vm->rmap_pool };
 
-	__init_system();
+	fprintf(stderr, "%-10s %6s %8s %8s %8s %10s %10s\n",
+			"pool", "size", "slabs", "in-use", "peak", "allocs", "frees");
+	for (int i = 0; i < sizeof(pools) / sizeof(*pools); i++) {
+		struct pool *p = pools[i];
 
-	while (fgets(command, sizeof(command), input)) {
-		char *tokens[MAX_NR_TOKENS] = { NULL };
-		int nr_tokens = 0;
+		fprintf(stderr, "%-10s %6zu %8u %8lu %8lu %10lu %10lu\n",
+				p->name, p->size, p->nr_slabs, p->nr_inuse, p->max_inuse,
+				p->nr_allocs, p->nr_frees);
+	}
+}
 
-		/* Make the command lowercase */
-		for (size_t i = 0; i < strlen(command); i++) {
-			command[i] = tolower(command[i]);
+/**
+ * Counters shown by __show_stats() and __dump_stats() in this order
+ */
+static const struct {
+	const char *name;
+	size_t offset;		/* Of the counter in struct vm_stats */
+} stat_fields[] = {
+	{ "tlb_hits", offsetof(struct vm_stats, tlb_hits) },
+	{ "tlb_misses", offsetof(struct vm_stats, tlb_misses) },
+	{ "tlb_prefetches", offsetof(struct vm_stats, tlb_prefetches) },
+	{ "prefetch_useful", offsetof(struct vm_stats, prefetch_useful) },
+	{ "prefetch_wasted", offsetof(struct vm_stats, prefetch_wasted) },
+	{ "pwc_hits", offsetof(struct vm_stats, pwc_hits) },
+	{ "pwc_misses", offsetof(struct vm_stats, pwc_misses) },
+	{ "faults_no_directory", offsetof(struct vm_stats, faults_no_directory) },
+	{ "faults_invalid_pte", offsetof(struct vm_stats, faults_invalid_pte) },
+	{ "faults_write_protect", offsetof(struct vm_stats, faults_write_protect) },
+	{ "cow_copies", offsetof(struct vm_stats, cow_copies) },
+	{ "write_enables", offsetof(struct vm_stats, write_enables) },
+	{ "huge_splits", offsetof(struct vm_stats, huge_splits) },
+	{ "directory_allocs", offsetof(struct vm_stats, directory_allocs) },
+	{ "directory_frees", offsetof(struct vm_stats, directory_frees) },
+	{ "directory_copies", offsetof(struct vm_stats, directory_copies) },
+	{ "forks", offsetof(struct vm_stats, forks) },
+	{ "spawns", offsetof(struct vm_stats, spawns) },
+	{ "vforks", offsetof(struct vm_stats, vforks) },
+	{ "vfork_breaks", offsetof(struct vm_stats, vfork_breaks) },
+	{ "exits", offsetof(struct vm_stats, exits) },
+	{ "switches", offsetof(struct vm_stats, switches) },
+	{ "tlb_shootdowns", offsetof(struct vm_stats, tlb_shootdowns) },
+	{ "tlb_shootdown_ipis", offsetof(struct vm_stats, tlb_shootdown_ipis) },
+	{ "tlb_shootdown_entries", offsetof(struct vm_stats, tlb_shootdown_entries) },
+	{ "major_faults", offsetof(struct vm_stats, major_faults) },
+	{ "minor_faults", offsetof(struct vm_stats, minor_faults) },
+	{ "swap_outs", offsetof(struct vm_stats, swap_outs) },
+	{ "swap_ins", offsetof(struct vm_stats, swap_ins) },
+	{ "zero_fills", offsetof(struct vm_stats, zero_fills) },
+	{ "zero_maps", offsetof(struct vm_stats, zero_maps) },
+	{ "peak_frames", offsetof(struct vm_stats, peak_frames) },
+	{ "wss_samples", offsetof(struct vm_stats, wss_samples) },
+	{ "peak_wss", offsetof(struct vm_stats, peak_wss) },
+	{ "local_accesses", offsetof(struct vm_stats, local_accesses) },
+	{ "remote_accesses", offsetof(struct vm_stats, remote_accesses) },
+	{ "node_fallbacks", offsetof(struct vm_stats, node_fallbacks) },
+	{ "cycles", offsetof(struct vm_stats, cycles) },
+	{ "memory_accesses", offsetof(struct vm_stats, memory_accesses) },
+	{ "access_cycles", offsetof(struct vm_stats, access_cycles) },
+	{ "compactions", offsetof(struct vm_stats, compactions) },
+	{ "compact_migrations", offsetof(struct vm_stats, compact_migrations) },
+};
+
+#define NR_STAT_FIELDS	(sizeof(stat_fields) / sizeof(stat_fields[0]))
+
+static inline unsigned long __stat_field(const struct vm_stats *s, unsigned int i)
+{
+	return *(const unsigned long *)((const char *)s + stat_fields[i].offset);
+}
+
+/* Average working set size of @p, or 0 if not sampled yet */
+static inline unsigned long __avg_wss(const struct process *p)
+{
+	return p->nr_wss_samples ? p->wss_sum / p->nr_wss_samples : 0;
+}
+
+/* Average memory access time in cycles */
+static inline double __amat(unsigned long access_cycles, unsigned long nr_accesses)
+{
+	return nr_accesses ? (double)access_cycles / nr_accesses : 0.0;
+}
+
+static unsigned long __process_cycles(const struct process *p)
+{
+	unsigned long cycles = 0;
+
+	for (unsigned int i = 0; i < NR_COST_EVENTS; i++) {
+		cycles += p->cycles[i];
+	}
+	return cycles;
+}
+
+static void __show_process_costs(struct process *p)
+{
+	fprintf(stderr, "%5u %12lu %8.2f", p->pid, __process_cycles(p),
+			__amat(p->access_cycles, p->nr_accesses));
+	for (unsigned int i = 0; i < NR_COST_EVENTS; i++) {
+		fprintf(stderr, " %12lu", p->cycles[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+static void __show_process_stats(struct process *p)
+{
+	fprintf(stderr, "%5u %12lu %12lu", p->pid, p->nr_tlb_hits, p->nr_tlb_misses);
+	if (vm->config.wss_interval) {
+		fprintf(stderr, " %8u %8lu %8u", p->wss, __avg_wss(p), p->max_wss);
+	}
+	if (vm->config.nr_nodes > 1) {
+		fprintf(stderr, " %12lu %12lu", p->nr_local_accesses, p->nr_remote_accesses);
+	}
+	fprintf(stderr, "\n");
+}
+
+static void __show_stats(void)
+{
+	struct process *p;
+
+	for (unsigned int i = 0; i < NR_STAT_FIELDS; i++) {
+		fprintf(stderr, "%-22s %12lu\n", stat_fields[i].name, __stat_field(&vm->stats, i));
+	}
+	for (unsigned int i = 0; i <= vm->config.nr_pt_levels; i++) {
+		fprintf(stderr, "walk_depth_%-11u %12lu\n", i, vm->stats.walk_depths[i]);
+	}
+	if (vm->stats.pwc_hits + vm->stats.pwc_misses) {
+		fprintf(stderr, "%-22s %12.2f\n", "pwc_hit%",
+				100.0 * vm->stats.pwc_hits / (vm->stats.pwc_hits + vm->stats.pwc_misses));
+	}
+	fprintf(stderr, "%-22s %12.2f\n", "amat",
+			__amat(vm->stats.access_cycles, vm->stats.memory_accesses));
+
+	fprintf(stderr, "\n%5s %12s %12s", "pid", "tlb_hits", "tlb_misses");
+	if (vm->config.wss_interval) {
+		fprintf(stderr, " %8s %8s %8s", "wss", "avg_wss", "max_wss");
+	}
+	if (vm->config.nr_nodes > 1) {
+		fprintf(stderr, " %12s %12s", "local", "remote");
+	}
+	fprintf(stderr, "\n");
+	for (unsigned int i = 0; i < vm->config.nr_cpus; i++) {
+		if (vm->cpus[i].curr) __show_process_stats(vm->cpus[i].curr);
+	}
+	list_for_each_entry(p, &vm->processes, list) {
+		__show_process_stats(p);
+	}
+
+	/* Cycles charged to each process by the events */
+	fprintf(stderr, "\n%5s %12s %8s", "pid", "cycles", "amat");
+	for (unsigned int i = 0; i < NR_COST_EVENTS; i++) {
+		fprintf(stderr, " %12s", cost_event_names[i]);
+	}
+	fprintf(stderr, "\n");
+	for (unsigned int i = 0; i < vm->config.nr_cpus; i++) {
+		if (vm->cpus[i].curr) __show_process_costs(vm->cpus[i].curr);
+	}
+	list_for_each_entry(p, &vm->processes, list) {
+		__show_process_costs(p);
+	}
+}
+
+static void __dump_process_stats(FILE *out, struct process *p, bool first)
+{
+	fprintf(out, "%s\n    { \"pid\": %u, \"tlb_hits\": %lu, \"tlb_misses\": %lu, "
+			"\"wss\": %u, \"avg_wss\": %lu, \"max_wss\": %u, "
+			"\"local_accesses\": %lu, \"remote_accesses\": %lu, "
+			"\"cycles\": %lu, \"amat\": %.2f, \"costs\": {",
+			first ? "" : ",", p->pid, p->nr_tlb_hits, p->nr_tlb_misses,
+			p->wss, __avg_wss(p), p->max_wss,
+			p->nr_local_accesses, p->nr_remote_accesses,
+			__process_cycles(p), __amat(p->access_cycles, p->nr_accesses));
+	for (unsigned int i = 0; i < NR_COST_EVENTS; i++) {
+		fprintf(out, "%s\"%s\": %lu", i ? ", " : " ", cost_event_names[i], p->cycles[i]);
+	}
+	fprintf(out, " } }");
+}
+
+static void __dump_stats(const char *path)
+{
+	FILE *out = fopen(path, "w");
+	struct process *p;
+	bool first = true;
+
+	if (!out) {
+		fprintf(stderr, "Unable to create %s\n", path);
+		return;
+	}
+
+	fprintf(out, "{\n");
+	for (unsigned int i = 0; i < NR_STAT_FIELDS; i++) {
+		fprintf(out, "  \"%s\": %lu,\n", stat_fields[i].name, __stat_field(&vm->stats, i));
+	}
+
+	fprintf(out, "  \"walk_depths\": [");
+	for (unsigned int i = 0; i <= vm->config.nr_pt_levels; i++) {
+		fprintf(out, "%s%lu", i ? ", " : "", vm->stats.walk_depths[i]);
+	}
+	fprintf(out, "],\n");
+	fprintf(out, "  \"amat\": %.2f,\n", __amat(vm->stats.access_cycles, vm->stats.memory_accesses));
+
+	fprintf(out, "  \"processes\": [");
+	for (unsigned int i = 0; i < vm->config.nr_cpus; i++) {
+		if (!vm->cpus[i].curr) continue;
+		__dump_process_stats(out, vm->cpus[i].curr, first);
+		first = false;
+	}
+	list_for_each_entry(p, &vm->processes, list) {
+		__dump_process_stats(out, p, first);
+		first = false;
+	}
+	fprintf(out, "\n  ]\n}\n");
+
+	fclose(out);
+}
+
+static void __count_mappings(struct pte_directory *dir, unsigned int level,
+		unsigned int counts[])
+{
+	for (unsigned int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		struct pte *pte = &dir->ptes[i];
+
+		if (!pte->valid) continue;
+
+		if (pte->huge) {
+			for (unsigned int j = 0; j < NR_PTES_PER_PAGE; j++) {
+				counts[pte->pfn + j]++;
+			}
+		} else if (level + 1 < vm->config.nr_pt_levels) {
+			__count_mappings(pte->dir, level + 1, counts);
+		} else {
+			counts[pte->pfn]++;
 		}
+	}
+}
 
-		if (parse_command(command, &nr_tokens, tokens) < 0) {
-			continue;
+static void __show_pageframes(void)
+{
+	unsigned int *counts = calloc(vm->config.nr_pageframes, sizeof(*counts));
+	struct process *p;
+
+	/**
+	 * @mapcounts counts a mapping in a directory once even when the directory
+	 * is shared by processes after fork. So, show the number of processes
+	 * mapping each frame by walking through their page tables.
+	 */
+	for (unsigned int i = 0; i < vm->config.nr_cpus; i++) {
+		if (!(p = vm->cpus[i].curr)) continue;
+		if (p->pagetable.root.valid) {
+			__count_mappings(p->pagetable.root.dir, 0, counts);
 		}
-		if (nr_tokens == 0) continue;
-
-		if (nr_tokens == 1) {
-			if (strmatch(tokens[0], "exit")) break;
-			if (strmatch(tokens[0], "show")) {
-				__show_pagetable();
-			} else if (strmatch(tokens[0], "frames")) {
-				__show_pageframes();
-			} else if (strmatch(tokens[0], "tlb")) {
-				__show_tlb();
-			} else if (strmatch(tokens[0], "help") || strmatch(tokens[0], "?")) {
-				__print_help();
-			} else {
-				printf("Unknown command %s\n", tokens[0]);
-			}
-		} else if (nr_tokens == 2) {
-			unsigned int arg = strtoimax(tokens[1], NULL, 0);
-
-			if (strmatch(tokens[0], "switch") || strmatch(tokens[0], "s")) {
-				switch_process(arg);
-			} else if (strmatch(tokens[0], "free") || strmatch(tokens[0], "f")) {
-				__free_page(arg);
-			} else if (strmatch(tokens[0], "read") || strmatch(tokens[0], "r")) {
-				__access_memory(arg, ACCESS_READ);
-			} else if (strmatch(tokens[0], "write") || strmatch(tokens[0], "w")) {
-				__access_memory(arg, ACCESS_WRITE);
-			} else {
-				printf("Unknown command %s\n", tokens[0]);
+	}
+	list_for_each_entry(p, &vm->processes, list) {
+		if (p->pagetable.root.valid) {
+			__count_mappings(p->pagetable.root.dir, 0, counts);
+		}
+	}
+
+	for (unsigned int i = 0; i < vm->config.nr_pageframes; i++) {
+		if (!counts[i]) continue;
+		fprintf(stderr, "%3u: %d\n", i, counts[i]);
+	}
+	fprintf(stderr, "\n");
+
+	free(counts);
+}
+
+static void __show_directory(struct pte_directory *dir, unsigned int level,
+		unsigned int perm, unsigned int indices[])
+{
+	for (unsigned int i = 0; i < NR_PTES_PER_PAGE; i++) {
+		struct pte *pte = &dir->ptes[i];
+		unsigned int rw = pte->rw & perm;
+
+		indices[level] = i;
+
+		if (pte->huge) {
+			for (unsigned int l = 0; l <= level; l++) {
+				fprintf(stderr, l ? ":%02d" : "%02d", indices[l]);
 			}
-		} else if (nr_tokens == 3) {
-			unsigned int vpn = strtoimax(tokens[1], NULL, 0);
-			unsigned int rw = __make_rwflag(tokens[2]);
-
-			if (strmatch(tokens[0], "alloc") || strmatch(tokens[0], "a")) {
-				if (!__alloc_page(vpn, rw)) break;
-			} else if (strmatch(tokens[0], "access")) {
-				__access_memory(vpn, rw);
-			} else {
-				printf("Unknown command %s\n", tokens[0]);
+			fprintf(stderr, ":** | %c %c%c | %-3d (huge)\n",
+				'v',
+				rw & ACCESS_READ ? 'r' : ' ',
+				rw & ACCESS_WRITE ? 'w' : ' ',
+				pte->pfn);
+			continue;
+		}
+
+		if (level + 1 < vm->config.nr_pt_levels) {
+			if (pte->valid) __show_directory(pte->dir, level + 1, rw, indices);
+			continue;
+		}
+
+		if (!verbose && pte_none(pte)) continue;
+		for (unsigned int l = 0; l <= level; l++) {
+			fprintf(stderr, l ? ":%02d" : "%02d", indices[l]);
+		}
+		/* Lazily allocated pages have no page frame yet */
+		if (pte->lazy) {
+			fprintf(stderr, " | z %c%c | -\n",
+				rw & ACCESS_READ ? 'r' : ' ',
+				rw & ACCESS_WRITE ? 'w' : ' ');
+			continue;
+		}
+		/* Swapped-out pages are shown with their swap slots */
+		fprintf(stderr, " | %c %c%c | %-3d\n",
+			pte->valid ? 'v' : (pte->swapped ? 's' : ' '),
+			pte->valid || pte->swapped ? (rw & ACCESS_READ ? 'r' : ' ') : ' ',
+			rw & ACCESS_WRITE ? 'w' : ' ',
+			pte->pfn);
+	}
+	if (level + 1 == vm->config.nr_pt_levels) fprintf(stderr, "\n");
+}
+
+static void __show_pagetable(void)
+{
+	unsigned int indices[MAX_NR_PT_LEVELS];
+
+	fprintf(stderr, "\n*** PID %u ***\n", vm->this_cpu->curr->pid);
+
+	if (vm->this_cpu->curr->pagetable.root.valid) {
+		__show_directory(vm->this_cpu->curr->pagetable.root.dir, 0,
+				vm->this_cpu->curr->pagetable.root.rw, indices);
+	}
+}
+
+static int __compare_tlb_seq(const void *a, const void *b)
+{
+	const struct tlb_entry *ta = *(const struct tlb_entry **)a;
+	const struct tlb_entry *tb = *(const struct tlb_entry **)b;
+
+	return (ta->seq > tb->seq) - (ta->seq < tb->seq);
+}
+
+static void __show_tlb(bool current_only)
+{
+	struct tlb_entry *tlb = vm->this_cpu->tlb_entries;
+	struct tlb_entry *entries[NR_TLB_ENTRIES];
+	unsigned int nr_entries = 0;
+
+	/* Print out the entries in the order of their insertion */
+	for (unsigned int i = 0; i < vm->config.tlb_sets * vm->config.tlb_ways; i++) {
+		if (!tlb[i].valid) continue;
+		if (current_only && tlb[i].asid != vm->this_cpu->curr->asid) continue;
+		entries[nr_entries++] = tlb + i;
+	}
+	qsort(entries, nr_entries, sizeof(*entries), __compare_tlb_seq);
+
+	for (unsigned int i = 0; i < nr_entries; i++) {
+		struct tlb_entry *t = entries[i];
+
+		if (!current_only) fprintf(stderr, "%3u: ", t->asid);
+		fprintf(stderr, "%c%c | %3d -> %-3d%s\n",
+				t->rw & ACCESS_READ ? 'r' : ' ',
+				t->rw & ACCESS_WRITE ? 'w' : ' ',
+				t->vpn, t->pfn, t->huge ? " (huge)" : "");
+	}
+}
+
+static void __print_help(void)
+{
+	printf("  help | ?     : Print out this help message \n");
+	printf("  exit         : Exit the simulation\n");
+	printf("\n");
+	printf("  switch [pid] : Do context switch to pid @pid\n");
+	printf("                 Fork @pid if there is no process with the pid\n");
+	printf("  spawn [pid]  : Create @pid with an empty address space, and switch to it\n");
+	printf("  vfork [pid]  : Create @pid borrowing the page table of the current\n");
+	printf("                 process until it changes it, and switch to it\n");
+	printf("  policy local|interleave\n");
+	printf("  policy preferred [node]\n");
+	printf("               : Set the memory policy of the current process\n");
+	printf("  kill [pid]   : Terminate the process @pid, or the current one\n");
+	printf("  exit [pid]   : Equivalent to kill @pid\n");
+	printf("  show         : Show the page table of the current process\n");
+	printf("  frames       : Show the status for each page frame\n");
+	printf("  tlb          : Show TLB entries with their ASIDs\n");
+	printf("  tlb current  : Show TLB entries of the current process\n");
+	printf("  pools        : Show the usage of object pools\n");
+	printf("  stats        : Show the event counters of the system\n");
+	printf("  compact      : Migrate pages to bring the free page frames together\n");
+	printf("  checkpoint [file]\n");
+	printf("               : Save the state of the system to @file\n");
+	printf("  restore [file]\n");
+	printf("               : Replace the system with the one saved in @file\n");
+	printf("\n");
+	printf("  alloc [vpn] r|w  : Allocate a page according to the rw flag\n");
+	printf("  alloc [vpn] r|w [order]\n");
+	printf("                   : Allocate 2^@order contiguous page frames to\n");
+	printf("                     the VPNs from @vpn\n");
+	printf("  alloc [vpn] r|w huge\n");
+	printf("                   : Map a huge page to the aligned VPNs from @vpn\n");
+	printf("  free [vpn]       : Deallocate the page at VPN @vpn\n");
+	printf("  access [vpn] r|w : Access VPN @vpn for read or write\n");
+	printf("  read [vpn]       : Equivalent to access @vpn r\n");
+	printf("  write [vpn]      : Equivalent to access @vpn w\n");
+	printf("\n");
+	printf("  [vpn] of alloc, free, and access may be a range of VPNs as\n");
+	printf("  [start]-[end] or [start]-[end]/[stride], including @end\n");
+	printf("\n");
+	printf("  @[cpu] [command] : Run the command on CPU @cpu instead of CPU 0\n");
+	printf("\n");
+}
+
+static void __print_prompt(void)
+{
+	/* The results held in the buffer come before the prompt */
+	if (vm->config.output_mode == OUTPUT_BUFFERED) fflush(stderr);
+
+	/* The CPU may be idle after its process is killed */
+	if (vm->config.nr_cpus > 1) printf("%u:", vm->this_cpu->id);
+
+	if (vm->this_cpu->curr) {
+		printf("%d >> ", vm->this_cpu->curr->pid);
+	} else {
+		printf("- >> ");
+	}
+}
+
+static bool __switch_process(unsigned int pid)
+{
+	/* A process cannot run on two CPUs at the same time */
+	for (unsigned int i = 0; i < vm->config.nr_cpus; i++) {
+		if (i == vm->this_cpu->id || !vm->cpus[i].curr) continue;
+		if (vm->cpus[i].curr->pid == pid) {
+			report("%u is running on cpu %u\n", pid, i);
+			return false;
+		}
+	}
+	switch_process(pid);
+
+	return true;
+}
+
+/**
+ * __create_process(@pid, @vfork)
+ *
+ * DESCRIPTION
+ *   Spawn the process @pid, or vfork it from the current process with
+ *   @vfork. Unlike the fork by switch, @pid should not exist yet.
+ */
+static bool __create_process(unsigned int pid, bool vfork)
+{
+	struct process *p;
+
+	for (unsigned int i = 0; i < vm->config.nr_cpus; i++) {
+		if (vm->cpus[i].curr && vm->cpus[i].curr->pid == pid) {
+			report("%u is running on cpu %u\n", pid, i);
+			return false;
+		}
+	}
+	hlist_for_each_entry(p, &vm->pid_hash[pid_hashfn(pid)], hash) {
+		if (p->pid == pid) {
+			report("%u exists already\n", pid);
+			return false;
+		}
+	}
+
+	if (vfork) {
+		vfork_process(pid);
+	} else {
+		spawn_process(pid);
+	}
+	return true;
+}
+
+/**
+ * __show_fragmentation(@when)
+ *
+ * DESCRIPTION
+ *   Show how the free page frames of each node are fragmented, tagged with
+ *   @when. Unusable is the share of the free frames that are not in blocks
+ *   large enough for a huge page.
+ */
+static void __show_fragmentation(const char *when)
+{
+	for (unsigned int node = 0; node < vm->config.nr_nodes; node++) {
+		struct buddy_zone *zone = &vm->frame_zones[node];
+		unsigned int largest = 0, nr_usable = 0;
+
+		for (unsigned int order = 0; order < MAX_ORDER; order++) {
+			unsigned int nr_blocks = buddy_nr_free_blocks(zone, order);
+
+			if (nr_blocks) largest = 1U << order;
+			if (order >= PTES_PER_PAGE_SHIFT) nr_usable += nr_blocks << order;
+		}
+		report("%-6s node %u: %u free, largest block %u, %.2f%% unusable\n", when,
+				node, zone->nr_free, largest,
+				zone->nr_free ? 100.0 * (zone->nr_free - nr_usable) / zone->nr_free : 0.0);
+	}
+}
+
+/**
+ * __compact()
+ *
+ * DESCRIPTION
+ *   Compact the page frames, and show the fragmentation before and after it
+ *   with the cost of the migration.
+ */
+static void __compact(void)
+{
+	unsigned long cycles = vm->stats.cycles;
+	unsigned int nr_migrated;
+
+	__show_fragmentation("before");
+	nr_migrated = compact_frames();
+	__show_fragmentation("after");
+	report("compact %u pages for %lu cycles\n", nr_migrated, vm->stats.cycles - cycles);
+}
+
+/**
+ * __set_mem_policy(@policy, @node)
+ *
+ * DESCRIPTION
+ *   Make the current process allocate page frames with @policy from now on.
+ *   @node is the preferred node for PREFERRED.
+ */
+static bool __set_mem_policy(unsigned int policy, unsigned int node)
+{
+	if (policy >= NR_MEM_POLICIES) {
+		report("Unknown memory policy %u\n", policy);
+		return false;
+	}
+	if (node >= vm->config.nr_nodes) {
+		report("No memory node %u\n", node);
+		return false;
+	}
+	vm->this_cpu->curr->mem_policy = policy;
+	if (policy == MEM_POLICY_PREFERRED) vm->this_cpu->curr->preferred_node = node;
+	return true;
+}
+
+static bool __kill_process(unsigned int pid)
+{
+	if (!kill_process(pid)) {
+		report("No process %u\n", pid);
+		return false;
+	}
+	report("kill %u\n", pid);
+
+	return true;
+}
+
+/**
+ * Operations to be run by the current process. They cannot run on idle CPUs
+ */
+static const bool op_needs_process[NR_OPCODES] = {
+	[OP_ACCESS] = true,
+	[OP_ALLOC] = true,
+	[OP_ALLOC_PAGES] = true,
+	[OP_ALLOC_HUGE] = true,
+	[OP_FREE] = true,
+	[OP_SHOW] = true,
+	[OP_TLB_CURRENT] = true,
+	[OP_KILL_CURRENT] = true,
+	[OP_POLICY] = true,
+};
+
+/**
+ * Operations that only show the state of the system. They print nothing in
+ * the OUTPUT_NONE mode
+ */
+static const bool op_shows_state[NR_OPCODES] = {
+	[OP_SHOW] = true,
+	[OP_FRAMES] = true,
+	[OP_TLB] = true,
+	[OP_TLB_CURRENT] = true,
+	[OP_POOLS] = true,
+	[OP_STATS] = true,
+	[OP_HELP] = true,
+};
+
+/**
+ * __do_op(@op)
+ *
+ * DESCRIPTION
+ *   Simulate @op on the system.
+ *
+ * RETURN
+ *   @true to continue the simulation
+ *   @false to stop the simulation
+ */
+static bool __do_op(const struct vm_op *op)
+{
+	bool ret = true;
+	unsigned int nr_free;
+
+	if (op->cpu >= vm->config.nr_cpus) {
+		fprintf(stderr, "No cpu %u\n", op->cpu);
+		return true;
+	}
+	vm->this_cpu = vm->cpus + op->cpu;
+
+	if (!vm->this_cpu->curr && op_needs_process[op->opcode]) {
+		fprintf(stderr, "No process is running on cpu %u\n", op->cpu);
+		return true;
+	}
+
+	if (vm->config.output_mode == OUTPUT_NONE && op_shows_state[op->opcode]) goto out;
+
+	switch (op->opcode) {
+	case OP_NOP:
+		break;
+	case OP_ACCESS:
+		ret = __access_range(op->arg, op->nr, op->stride, op->rw);
+		break;
+	case OP_ALLOC:
+		ret = __alloc_range(op->arg, op->nr, op->stride, op->rw);
+		break;
+	case OP_ALLOC_PAGES:
+		ret = __alloc_pages(op->arg, op->rw, op->order);
+		break;
+	case OP_ALLOC_HUGE:
+		ret = __alloc_huge_page(op->arg, op->rw);
+		break;
+	case OP_FREE:
+		ret = __free_range(op->arg, op->nr, op->stride);
+		break;
+	case OP_SWITCH:
+		ret = __switch_process(op->arg);
+		break;
+	case OP_SPAWN:
+	case OP_VFORK:
+		ret = __create_process(op->arg, op->opcode == OP_VFORK);
+		break;
+	case OP_POLICY:
+		ret = __set_mem_policy(op->arg, op->nr);
+		break;
+	case OP_KILL:
+		ret = __kill_process(op->arg);
+		break;
+	case OP_KILL_CURRENT:
+		ret = __kill_process(vm->this_cpu->curr->pid);
+		break;
+	case OP_CHECKPOINT:
+		ret = __checkpoint(trace_path(op->arg));
+		break;
+	case OP_RESTORE:
+		ret = __restore(trace_path(op->arg));
+		break;
+	case OP_SHOW:
+		__show_pagetable();
+		break;
+	case OP_FRAMES:
+		__show_pageframes();
+		break;
+	case OP_TLB:
+		__show_tlb(false);
+		break;
+	case OP_TLB_CURRENT:
+		__show_tlb(true);
+		break;
+	case OP_POOLS:
+		__show_pools();
+		break;
+	case OP_STATS:
+		__show_stats();
+		break;
+	case OP_COMPACT:
+		__compact();
+		break;
+	case OP_HELP:
+		__print_help();
+		break;
+	case OP_EXIT:
+		return false;
+	default:
+		fprintf(stderr, "Unknown operation %u\n", op->opcode);
+		return true;
+	}
+
+	flush_tlb_shootdowns();
+
+	nr_free = 0;
+	for (unsigned int i = 0; i < vm->config.nr_nodes; i++) {
+		nr_free += vm->frame_zones[i].nr_free;
+	}
+	if (vm->config.nr_pageframes - nr_free > vm->stats.peak_frames) {
+		vm->stats.peak_frames = vm->config.nr_pageframes - nr_free;
+	}
+
+out:
+	vm->summary[op->opcode].nr_ops++;
+	if (!ret) vm->summary[op->opcode].nr_failed++;
+
+	/* Failing to allocate pages stops the simulation */
+	switch (op->opcode) {
+	case OP_ALLOC:
+	case OP_ALLOC_PAGES:
+	case OP_ALLOC_HUGE:
+		return ret;
+	default:
+		return true;
+	}
+}
+
+static void __show_summary(void)
+{
+	fprintf(stderr, "%-12s %12s %12s\n", "operation", "count", "failed");
+	for (unsigned int i = 0; i < NR_OPCODES; i++) {
+		if (!vm->summary[i].nr_ops) continue;
+
+		fprintf(stderr, "%-12s %12lu %12lu\n",
+				op_names[i], vm->summary[i].nr_ops, vm->summary[i].nr_failed);
+	}
+}
+
+static void __finish_simulation(void)
+{
+	if (vm->config.output_mode == OUTPUT_SUMMARY) __show_summary();
+	if (stats_file) __dump_stats(stats_file);
+}
+
+static void __do_simulation(FILE *input)
+{
+	char command[MAX_COMMAND_LEN] = { 0 };
+	char line[MAX_COMMAND_LEN];
+
+	while (fgets(command, sizeof(command), input)) {
+		char *tokens[MAX_NR_TOKENS] = { NULL };
+		int nr_tokens = 0;
+		struct vm_op op;
+
+		memcpy(line, command, sizeof(line));
+		if (!parse_command(command, &nr_tokens, tokens)) continue;
+
+		if (!trace_parse(nr_tokens, tokens, line, &op)) {
+			printf("Unknown command %s\n", tokens[0]);
+		} else if (!__do_op(&op)) {
+			break;
+		}
+
+		if (verbose) __print_prompt();
+	}
+}
+
+/**
+ * __replay_trace(@ops, @nr_ops)
+ *
+ * DESCRIPTION
+ *   Simulate the operations of a binary trace compiled by tracec, or of a
+ *   text trace loaded by __load_trace().
+ */
+static void __replay_trace(const struct vm_op *ops, size_t nr_ops)
+{
+	for (size_t i = 0; i < nr_ops; i++) {
+		if (!__do_op(&ops[i])) break;
+	}
+}
+
+static bool __parse_tlb_policy(struct vm_config *cfg, const char *name)
+{
+	for (int i = 0; i < NR_TLB_POLICIES; i++) {
+		if (strcasecmp(name, tlb_policy_names[i]) == 0) {
+			cfg->tlb_policy = i;
+			return true;
+		}
+	}
+	fprintf(stderr, "Unknown TLB eviction policy %s\n", name);
+	return false;
+}
+
+static bool __parse_tlb_prefetch(struct vm_config *cfg, const char *name)
+{
+	for (int i = 0; i < NR_TLB_PREFETCHES; i++) {
+		if (strcasecmp(name, tlb_prefetch_names[i]) == 0) {
+			cfg->tlb_prefetch = i;
+			return true;
+		}
+	}
+	fprintf(stderr, "Unknown TLB prefetch policy %s\n", name);
+	return false;
+}
+
+static bool __parse_page_policy(struct vm_config *cfg, const char *name)
+{
+	for (int i = 0; i < NR_PAGE_POLICIES; i++) {
+		if (strcasecmp(name, page_policy_names[i]) == 0) {
+			cfg->page_policy = i;
+			return true;
+		}
+	}
+	fprintf(stderr, "Unknown page replacement policy %s\n", name);
+	return false;
+}
+
+static bool __parse_mem_policy(struct vm_config *cfg, const char *name)
+{
+	for (int i = 0; i < NR_MEM_POLICIES; i++) {
+		if (strcasecmp(name, mem_policy_names[i]) == 0) {
+			cfg->mem_policy = i;
+			return true;
+		}
+	}
+	fprintf(stderr, "Unknown memory policy %s\n", name);
+	return false;
+}
+
+/* Set the cycles of the events given as 'event=cycles' separated by commas */
+static bool __parse_costs(struct vm_config *cfg, const char *arg)
+{
+	while (*arg) {
+		const char *value = strchr(arg, '=');
+		char *end;
+		int i;
+
+		for (i = 0; value && i < NR_COST_EVENTS; i++) {
+			if (strlen(cost_event_names[i]) == value - arg &&
+					strncasecmp(arg, cost_event_names[i], value - arg) == 0) break;
+		}
+		if (!value || i == NR_COST_EVENTS) {
+			fprintf(stderr, "Unknown event to charge cycles for in %s\n", arg);
+			return false;
+		}
+
+		cfg->costs[i] = strtoumax(value + 1, &end, 0);
+		if (end == value + 1 || (*end && *end != ',')) {
+			fprintf(stderr, "Invalid number of cycles in %s\n", arg);
+			return false;
+		}
+		arg = *end ? end + 1 : end;
+	}
+	return true;
+}
+
+static bool __parse_output_mode(struct vm_config *cfg, const char *name)
+{
+	for (int i = 0; i < NR_OUTPUT_MODES; i++) {
+		if (strcasecmp(name, output_mode_names[i]) == 0) {
+			cfg->output_mode = i;
+			return true;
+		}
+	}
+	fprintf(stderr, "Unknown output mode %s\n", name);
+	return false;
+}
+
+/**
+ * __parse_option(@cfg, @tlb_entries, @opt, @arg)
+ *
+ * DESCRIPTION
+ *   Apply the option @opt of the system configuration with @arg to @cfg.
+ *   The options in FLAG_OPTIONS take no @arg. The number of TLB entries is
+ *   set to @tlb_entries, and is fitted into the TLB sets later by
+ *   __check_config().
+ *
+ * RETURN
+ *   @true if @opt is valid
+ *   @false otherwise
+ */
+static bool __parse_option(struct vm_config *cfg, unsigned int *tlb_entries,
+		int opt, const char *arg)
+{
+	switch (opt) {
+	case 's':
+		cfg->tlb_sets = strtoimax(arg, NULL, 0);
+		break;
+	case 'w':
+		cfg->tlb_ways = strtoimax(arg, NULL, 0);
+		break;
+	case 'n':
+		*tlb_entries = strtoimax(arg, NULL, 0);
+		break;
+	case 'e':
+		return __parse_tlb_policy(cfg, arg);
+	case 'p':
+		cfg->nr_pwc_entries = strtoimax(arg, NULL, 0);
+		break;
+	case 'f':
+		return __parse_tlb_prefetch(cfg, arg);
+	case 'g':
+		cfg->prefetch_degree = strtoimax(arg, NULL, 0);
+		break;
+	case 'a':
+		cfg->nr_asids = strtoimax(arg, NULL, 0);
+		break;
+	case 'm':
+		cfg->nr_pageframes = strtoimax(arg, NULL, 0);
+		break;
+	case 'l':
+		cfg->nr_pt_levels = strtoimax(arg, NULL, 0);
+		break;
+	case 'b':
+		cfg->ptes_per_page_shift = strtoimax(arg, NULL, 0);
+		break;
+	case 'c':
+		cfg->nr_cpus = strtoimax(arg, NULL, 0);
+		break;
+	case 'N':
+		cfg->nr_nodes = strtoimax(arg, NULL, 0);
+		break;
+	case 'M':
+		return __parse_mem_policy(cfg, arg);
+	case 'd':
+		cfg->nr_swap_slots = strtoimax(arg, NULL, 0);
+		break;
+	case 'r':
+		return __parse_page_policy(cfg, arg);
+	case 'k':
+		cfg->ws_window = strtoimax(arg, NULL, 0);
+		break;
+	case 'z':
+		cfg->lazy_alloc = true;
+		break;
+	case 'i':
+		cfg->wss_interval = strtoimax(arg, NULL, 0);
+		break;
+	case 'C':
+		cfg->compact_interval = strtoimax(arg, NULL, 0);
+		break;
+	case 'T':
+		return __parse_costs(cfg, arg);
+	default:
+		return false;
+	}
+	return true;
+}
+
+static bool __check_config(struct vm_config *cfg, unsigned int tlb_entries)
+{
+	if (!cfg->tlb_sets || (cfg->tlb_sets & (cfg->tlb_sets - 1))) {
+		fprintf(stderr, "The number of TLB sets should be a power of 2\n");
+		return false;
+	}
+	if (tlb_entries) {
+		if (tlb_entries % cfg->tlb_sets) {
+			fprintf(stderr, "%u TLB entries cannot be divided into %u sets\n",
+					tlb_entries, cfg->tlb_sets);
+			return false;
+		}
+		cfg->tlb_ways = tlb_entries / cfg->tlb_sets;
+	}
+	if (!cfg->tlb_ways ||
+			cfg->tlb_sets * cfg->tlb_ways > NR_TLB_ENTRIES) {
+		fprintf(stderr, "TLB can have up to %u entries in total\n", NR_TLB_ENTRIES);
+		return false;
+	}
+	if (cfg->nr_pwc_entries > NR_PWC_ENTRIES) {
+		fprintf(stderr, "Page-walk cache can have up to %u entries\n", NR_PWC_ENTRIES);
+		return false;
+	}
+	if (!cfg->nr_asids || cfg->nr_asids > NR_ASIDS) {
+		fprintf(stderr, "The number of ASIDs should be between 1 and %u\n", NR_ASIDS);
+		return false;
+	}
+	if (!cfg->nr_cpus || cfg->nr_cpus > MAX_NR_CPUS) {
+		fprintf(stderr, "The number of CPUs should be between 1 and %u\n", MAX_NR_CPUS);
+		return false;
+	}
+	if (cfg->nr_asids < cfg->nr_cpus) {
+		fprintf(stderr, "Each of the %u CPUs needs an ASID\n", cfg->nr_cpus);
+		return false;
+	}
+	if (cfg->nr_swap_slots >= -1U) {
+		fprintf(stderr, "Invalid number of swap slots\n");
+		return false;
+	}
+	if (!cfg->nr_pageframes || cfg->nr_pageframes >= -1U) {
+		fprintf(stderr, "Invalid number of page frames\n");
+		return false;
+	}
+	if (!cfg->nr_nodes || cfg->nr_nodes > MAX_NR_NODES) {
+		fprintf(stderr, "The number of memory nodes should be between 1 and %u\n",
+				MAX_NR_NODES);
+		return false;
+	}
+	if (cfg->nr_pageframes < cfg->nr_nodes) {
+		fprintf(stderr, "Each of the %u memory nodes needs a page frame\n", cfg->nr_nodes);
+		return false;
+	}
+	if (!cfg->nr_pt_levels || cfg->nr_pt_levels > MAX_NR_PT_LEVELS) {
+		fprintf(stderr, "Page tables can have 1 to %u levels\n", MAX_NR_PT_LEVELS);
+		return false;
+	}
+	if (!cfg->ptes_per_page_shift ||
+			cfg->nr_pt_levels * cfg->ptes_per_page_shift > sizeof(unsigned int) * 8) {
+		fprintf(stderr, "Page tables cannot translate %u bits of VPN\n",
+				cfg->nr_pt_levels * cfg->ptes_per_page_shift);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * A configuration of the sweep and its result
+ */
+struct sweep_run {
+	char label[MAX_COMMAND_LEN];	/* Options of the configuration */
+	struct vm_config cfg;
+
+	struct vm_stats counters;
+	unsigned long nr_ops;
+	unsigned long nr_failed;
+	double elapsed;			/* In seconds */
+};
+
+/**
+ * Configuration sweep. Worker threads take the runs in order, and simulate
+ * @ops on their own instances of the system with the configurations.
+ */
+static struct {
+	const struct vm_op *ops;
+	size_t nr_ops;
+
+	struct sweep_run *runs;
+	unsigned int nr_runs;
+
+	pthread_mutex_t lock;
+	unsigned int next_run;	/* The next run to take. Protected by @lock */
+} sweep = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * __load_sweep(@path)
+ *
+ * DESCRIPTION
+ *   Read the configurations of the sweep from the file at @path. Each line
+ *   of the file has the options of a configuration, which are applied on
+ *   top of the options from the command line. E.g.,
+ *
+ *     # TLB geometry and eviction policy
+ *     -s 16 -w 4 -e lru
+ *     -n 128 -e clock -m 256
+ *
+ * RETURN
+ *   @true if all configurations are valid
+ *   @false otherwise
+ */
+static bool __load_sweep(const char *path)
+{
+	FILE *input = fopen(path, "r");
+	char command[MAX_COMMAND_LEN] = { 0 };
+	char line[MAX_COMMAND_LEN];
+	unsigned long lineno = 0;
+	unsigned int max_runs = 0;
+
+	if (!input) {
+		fprintf(stderr, "No sweep file %s\n", path);
+		return false;
+	}
+
+	while (fgets(command, sizeof(command), input)) {
+		char *tokens[MAX_NR_TOKENS] = { NULL };
+		int nr_tokens = 0;
+		unsigned int tlb_entries = 0;
+		struct sweep_run *run;
+
+		lineno++;
+
+		/* The options are told apart by their case, which parsing takes away */
+		memcpy(line, command, sizeof(line));
+		if (!parse_command(command, &nr_tokens, tokens)) continue;
+
+		if (sweep.nr_runs == max_runs) {
+			max_runs = max_runs ? max_runs * 2 : 16;
+			sweep.runs = realloc(sweep.runs, sizeof(*sweep.runs) * max_runs);
+		}
+		run = sweep.runs + sweep.nr_runs;
+		memset(run, 0x00, sizeof(*run));
+		run->cfg = options;
+		run->cfg.output_mode = OUTPUT_NONE;
+
+		for (int i = 0; i < nr_tokens; i++) {
+			char *option = line + (tokens[i] - command);
+			bool flag = option[0] == '-' && option[1] && strchr(FLAG_OPTIONS, option[1]);
+			const char *arg = flag ? NULL : tokens[i + 1];
+
+			if (option[0] != '-' || !option[1] || tokens[i][2] || (!flag && !arg) ||
+					!__parse_option(&run->cfg, &tlb_entries, option[1], arg)) {
+				fprintf(stderr, "line %lu: Invalid option %.*s\n", lineno,
+						(int)strlen(tokens[i]), option);
+				goto out_fail;
 			}
-		} else {
-			assert(!"Unknown command in trace");
+			snprintf(run->label + strlen(run->label), sizeof(run->label) - strlen(run->label),
+					"%s-%c%s%s", i ? " " : "", option[1], arg ? " " : "", arg ? arg : "");
+			if (arg) i++;
 		}
+		if (!__check_config(&run->cfg, tlb_entries)) {
+			fprintf(stderr, "line %lu: Invalid configuration\n", lineno);
+			goto out_fail;
+		}
+		sweep.nr_runs++;
+	}
+	fclose(input);
 
-		if (verbose) printf("%d >> ", current->pid);
+	if (!sweep.nr_runs) {
+		fprintf(stderr, "No configuration in %s\n", path);
+		return false;
 	}
+	return true;
+
+out_fail:
+	fclose(input);
+	return false;
+}
+
+/**
+ * __load_trace(@input, @nr_ops)
+ *
+ * DESCRIPTION
+ *   Parse the text trace from @input into operations so that the operations
+ *   are simulated over and over without parsing them again.
+ *
+ * RETURN
+ *   The operations of the trace, and @nr_ops is set to the number of them
+ */
+static struct vm_op *__load_trace(FILE *input, size_t *nr_ops)
+{
+	char command[MAX_COMMAND_LEN] = { 0 };
+	char line[MAX_COMMAND_LEN];
+	struct vm_op *ops = NULL;
+	size_t max_ops = 0;
+
+	*nr_ops = 0;
+
+	while (fgets(command, sizeof(command), input)) {
+		char *tokens[MAX_NR_TOKENS] = { NULL };
+		int nr_tokens = 0;
+
+		memcpy(line, command, sizeof(line));
+		if (!parse_command(command, &nr_tokens, tokens)) continue;
+
+		if (*nr_ops == max_ops) {
+			max_ops = max_ops ? max_ops * 2 : 1024;
+			ops = realloc(ops, sizeof(*ops) * max_ops);
+		}
+		if (!trace_parse(nr_tokens, tokens, line, ops + *nr_ops)) {
+			printf("Unknown command %s\n", tokens[0]);
+			continue;
+		}
+		(*nr_ops)++;
+	}
+	return ops;
+}
+
+static double __elapsed(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *__sweep_worker(void *arg)
+{
+	while (true) {
+		struct sweep_run *run;
+		struct timespec start, end;
+
+		pthread_mutex_lock(&sweep.lock);
+		if (sweep.next_run == sweep.nr_runs) {
+			pthread_mutex_unlock(&sweep.lock);
+			break;
+		}
+		run = sweep.runs + sweep.next_run++;
+		pthread_mutex_unlock(&sweep.lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		__init_system(&run->cfg);
+		if (!restore_file || __restore_system(restore_file)) {
+			__replay_trace(sweep.ops, sweep.nr_ops);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		run->elapsed = __elapsed(&start, &end);
+
+		run->counters = vm->stats;
+		for (unsigned int i = 0; i < NR_OPCODES; i++) {
+			run->nr_ops += vm->summary[i].nr_ops;
+			run->nr_failed += vm->summary[i].nr_failed;
+		}
+		__exit_system();
+	}
+	return NULL;
+}
+
+static void __show_sweep(void)
+{
+	int width = strlen("config");
+
+	for (unsigned int i = 0; i < sweep.nr_runs; i++) {
+		if (strlen(sweep.runs[i].label) > width) width = strlen(sweep.runs[i].label);
+	}
+
+	fprintf(stderr, "%-*s %10s %10s %8s %12s %8s %10s %10s %10s %10s %14s %8s %10s\n",
+			width, "config", "ops", "failed", "tlb_hit%", "tlb_misses", "pwc_hit%",
+			"faults", "major", "cow", "shootdowns", "cycles", "amat", "time(ms)");
+	for (unsigned int i = 0; i < sweep.nr_runs; i++) {
+		struct sweep_run *run = sweep.runs + i;
+		struct vm_stats *s = &run->counters;
+		unsigned long lookups = s->tlb_hits + s->tlb_misses;
+		unsigned long walks = s->pwc_hits + s->pwc_misses;
+
+		fprintf(stderr, "%-*s %10lu %10lu %8.2f %12lu %8.2f %10lu %10lu %10lu %10lu "
+				"%14lu %8.2f %10.1f\n", width, run->label, run->nr_ops, run->nr_failed,
+				lookups ? 100.0 * s->tlb_hits / lookups : 0.0, s->tlb_misses,
+				walks ? 100.0 * s->pwc_hits / walks : 0.0,
+				s->faults_no_directory + s->faults_invalid_pte +
+				s->faults_write_protect + s->major_faults,
+				s->major_faults, s->cow_copies, s->tlb_shootdowns, s->cycles,
+				__amat(s->access_cycles, s->memory_accesses), run->elapsed * 1000);
+	}
+}
+
+/**
+ * __do_sweep(@path, @nr_threads)
+ *
+ * DESCRIPTION
+ *   Simulate the trace at @path with each configuration of the sweep on
+ *   @nr_threads worker threads, and compare the results. TLB is always
+ *   simulated, and nothing but errors is printed while simulating.
+ *
+ * RETURN
+ *   @true if all configurations are simulated
+ *   @false otherwise
+ */
+static bool __do_sweep(const char *path, unsigned int nr_threads)
+{
+	pthread_t threads[MAX_SWEEP_THREADS];
+	const struct vm_op *mapped;
+	struct vm_op *loaded = NULL;
+	unsigned int nr_started = 0;
+
+	mapped = trace_map(path, &sweep.nr_ops);
+	if (mapped) {
+		sweep.ops = mapped;
+	} else {
+		FILE *input = fopen(path, "r");
+
+		if (!input) {
+			fprintf(stderr, "No input file %s\n", path);
+			return false;
+		}
+		sweep.ops = loaded = __load_trace(input, &sweep.nr_ops);
+		fclose(input);
+	}
+
+	print_tlb_result = true;
+	verbose = false;
+
+	if (nr_threads > sweep.nr_runs) nr_threads = sweep.nr_runs;
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		if (pthread_create(threads + i, NULL, __sweep_worker, NULL)) {
+			fprintf(stderr, "Unable to create worker threads\n");
+			break;
+		}
+		nr_started++;
+	}
+	/* Run on this thread if no worker is started */
+	if (!nr_started) __sweep_worker(NULL);
+
+	for (unsigned int i = 0; i < nr_started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	__show_sweep();
+
+	if (mapped) trace_unmap(mapped, sweep.nr_ops);
+	free(loaded);
+	free(sweep.runs);
+
+	return true;
 }
 
 static void __print_usage(const char * name)
 {
-	printf("Usage: %s {-q} {-f [workload file]}\n", name);
+	printf("Usage: %s {options} {workload file}\n", name);
 	printf("\n");
 	printf("  -t: Show TLB result\n");
+	printf("  -s: Number of TLB sets (default: %u)\n", options.tlb_sets);
+	printf("  -w: Number of TLB ways per set (default: %u)\n", options.tlb_ways);
+	printf("  -n: Number of TLB entries. Overrides -w to fit the entries in the sets\n");
+	printf("  -e: TLB eviction policy; fifo, lru, random, or clock (default: %s)\n",
+			tlb_policy_names[options.tlb_policy]);
+	printf("  -p: Number of page-walk cache entries; 0 to disable (default: %u, up to %u)\n",
+			options.nr_pwc_entries, NR_PWC_ENTRIES);
+	printf("  -f: TLB prefetch policy on misses; none, next, or stride (default: %s)\n",
+			tlb_prefetch_names[options.tlb_prefetch]);
+	printf("  -g: Number of translations to prefetch on a miss (default: %u)\n",
+			options.prefetch_degree);
+	printf("  -a: Number of ASIDs to tag TLB entries (default: %u)\n", options.nr_asids);
+	printf("  -m: Number of page frames (default: %u)\n", options.nr_pageframes);
+	printf("  -l: Number of page table levels (default: %u, up to %u)\n",
+			options.nr_pt_levels, MAX_NR_PT_LEVELS);
+	printf("  -b: Number of VPN bits translated by each page table level (default: %u)\n",
+			options.ptes_per_page_shift);
+	printf("  -c: Number of CPUs (default: %u, up to %u)\n", options.nr_cpus, MAX_NR_CPUS);
+	printf("  -N: Number of memory nodes (default: %u, up to %u)\n",
+			options.nr_nodes, MAX_NR_NODES);
+	printf("  -M: Memory policy of the processes; local, interleave, or preferred\n");
+	printf("      (default: %s)\n", mem_policy_names[options.mem_policy]);
+	printf("  -d: Number of swap slots to evict pages to (default: %u)\n",
+			options.nr_swap_slots);
+	printf("  -r: Page replacement policy; fifo, clock, lru, or ws (default: %s)\n",
+			page_policy_names[options.page_policy]);
+	printf("  -k: Working set window of the ws policy in accesses (default: %u)\n",
+			options.ws_window);
+	printf("  -z: Allocate pages lazily on the first access to them\n");
+	printf("  -i: Sample the working set sizes every given number of accesses;\n");
+	printf("      0 to disable (default: %u)\n", options.wss_interval);
+	printf("  -C: Compact the page frames every given number of accesses;\n");
+	printf("      0 to disable (default: %u)\n", options.compact_interval);
+	printf("  -T: Cycles to charge for events of the timing model, given as\n");
+	printf("      event=cycles separated by commas (default:");
+	for (unsigned int i = 0; i < NR_COST_EVENTS; i++) {
+		printf("%s%s=%u", i ? "," : " ", cost_event_names[i], options.costs[i]);
+	}
+	printf(")\n");
+	printf("  -o: Output mode; text, buffered, summary, or none (default: %s)\n",
+			output_mode_names[options.output_mode]);
+	printf("  -j: Dump the statistics in JSON to the file at exit\n");
+	printf("  -R: Restore the system from the checkpoint before the simulation\n");
+	printf("  -S: Simulate the workload with each configuration in the file, and\n");
+	printf("      compare them. Each line has the options above for a configuration\n");
+	printf("  -P: Number of threads for -S (default: online CPUs, up to %u)\n",
+			MAX_SWEEP_THREADS);
 	printf("  -q: Run quietly\n\n");
 }
 
@@ -399,8 +2175,11 @@ int main(int argc, char * argv[])
 {
 	int opt;
 	FILE *input = stdin;
+	unsigned int tlb_entries = 0;
+	const char *sweep_file = NULL;
+	long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
 
-	while ((opt = getopt(argc, argv, "qht")) != -1) {
+	while ((opt = getopt(argc, argv, "qhts:w:n:e:p:f:g:a:m:l:b:c:N:M:d:r:k:zi:C:T:o:j:R:S:P:")) != -1) {
 		switch (opt) {
 		case 'q':
 			verbose = false;
@@ -408,6 +2187,44 @@ int main(int argc, char * argv[])
 		case 't':
 			print_tlb_result = true;
 			break;
+		case 's':
+		case 'w':
+		case 'n':
+		case 'e':
+		case 'p':
+		case 'f':
+		case 'g':
+		case 'a':
+		case 'm':
+		case 'l':
+		case 'b':
+		case 'c':
+		case 'N':
+		case 'M':
+		case 'd':
+		case 'r':
+		case 'k':
+		case 'z':
+		case 'i':
+		case 'C':
+		case 'T':
+			if (!__parse_option(&options, &tlb_entries, opt, optarg)) return EXIT_FAILURE;
+			break;
+		case 'o':
+			if (!__parse_output_mode(&options, optarg)) return EXIT_FAILURE;
+			break;
+		case 'j':
+			stats_file = optarg;
+			break;
+		case 'R':
+			restore_file = optarg;
+			break;
+		case 'S':
+			sweep_file = optarg;
+			break;
+		case 'P':
+			nr_threads = strtoimax(optarg, NULL, 0);
+			break;
 		case 'h':
 		default:
 			__print_usage(argv[0]);
@@ -415,6 +2232,26 @@ int main(int argc, char * argv[])
 		}
 	}
 
+	if (!__check_config(&options, tlb_entries)) return EXIT_FAILURE;
+
+	if (sweep_file) {
+		if (nr_threads < 1) nr_threads = 1;
+		if (nr_threads > MAX_SWEEP_THREADS) nr_threads = MAX_SWEEP_THREADS;
+
+		if (!argv[optind]) {
+			fprintf(stderr, "No workload file to sweep\n");
+			return EXIT_FAILURE;
+		}
+		if (!__load_sweep(sweep_file)) return EXIT_FAILURE;
+
+		return __do_sweep(argv[optind], nr_threads) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/* Hold the results in the buffer instead of writing them one by one */
+	if (options.output_mode == OUTPUT_BUFFERED) {
+		setvbuf(stderr, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+	}
+
 	if (verbose && !argv[optind]) {
 		printf("***************************************************************************\n");
 		printf(" Welcome to\n\n");
@@ -431,24 +2268,53 @@ int main(int argc, char * argv[])
 	}
 
 	if (argv[optind]) {
+		const struct vm_op *ops;
+		size_t nr_ops;
+
 		if (verbose) printf("Use file \"%s\" for input.\n", argv[optind]);
+		verbose = false;
+
+		/* Replay binary traces directly from the file */
+		ops = trace_map(argv[optind], &nr_ops);
+		if (ops) {
+			__init_system(&options);
+			if (restore_file && !__restore_system(restore_file)) {
+				__exit_system();
+				trace_unmap(ops, nr_ops);
+				return EXIT_FAILURE;
+			}
+			__replay_trace(ops, nr_ops);
+			__finish_simulation();
+			__exit_system();
+
+			trace_unmap(ops, nr_ops);
+			return EXIT_SUCCESS;
+		}
 
 		input = fopen(argv[optind], "r");
 		if (!input) {
 			fprintf(stderr, "No input file %s\n", argv[optind]);
 			return EXIT_FAILURE;
 		}
-		verbose = false;
 	} else {
 		if (verbose) printf("Use stdin for input.\n");
 	}
 
+	__init_system(&options);
+	if (restore_file && !__restore_system(restore_file)) {
+		__exit_system();
+		if (input != stdin) fclose(input);
+		return EXIT_FAILURE;
+	}
+
 	if (verbose) {
 		printf("Type 'help' or '?' for help.\n\n");
-		printf("%d >> ", current->pid);
+		__print_prompt();
 	}
 
 	__do_simulation(input);
+	__finish_simulation();
+	__exit_system();
 
 	if (input != stdin) fclose(input);
 
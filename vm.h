@@ -16,13 +16,27 @@
 #define __VM_H__
 
 #include "types.h"
+#include "list_head.h"
+#include "buddy.h"
+#include "pool.h"
+#include "trace.h"
 
-/* The number of physical page frames of the system */
-#define NR_PAGEFRAMES	128
+/* The default number of physical page frames of the system */
+#define DEFAULT_NR_PAGEFRAMES	128
+
+/* The default number of PTEs in a page and the levels of page tables */
+#define DEFAULT_PTES_PER_PAGE_SHIFT	4
+#define DEFAULT_NR_PT_LEVELS	2
+
+/* Page tables can be up to this deep */
+#define MAX_NR_PT_LEVELS	6
 
 /* The number of PTEs in a page */
-#define PTES_PER_PAGE_SHIFT	4
-#define NR_PTES_PER_PAGE    (1 << PTES_PER_PAGE_SHIFT)
+#define PTES_PER_PAGE_SHIFT	(vm->config.ptes_per_page_shift)
+#define NR_PTES_PER_PAGE	(1U << PTES_PER_PAGE_SHIFT)
+
+/* The number of VPNs in the address space of a process */
+#define NR_VPNS		(1UL << (PTES_PER_PAGE_SHIFT * vm->config.nr_pt_levels))
 
 /* Protection bits for read and write */
 #define ACCESS_NONE  0x00
@@ -30,21 +44,139 @@
 #define ACCESS_WRITE 0x02
 
 /**
- * 2-level page table abstraction
+ * Multi-level page table abstraction
+ *
+ * A page table consists of @config.nr_pt_levels levels of directories, each
+ * of which has NR_PTES_PER_PAGE entries. An entry in the last level maps a
+ * page frame, whereas an entry in the upper levels points to the directory
+ * of the next level. @pagetable->root points to the top-level directory
+ * like the page table base of real MMUs, so the walk for a VPN starts from
+ * the root entry and goes down one level per VPN index.
+ *
+ * Directories can be shared by processes after fork, counted by
+ * @pte_directory->refcount. The entries pointing to a shared directory are
+ * write-protected, and the MMU allows writes only when all the entries on
+ * the walk are writable. The directory is copied on the first write, just
+ * like the copy-on-write of pages.
+ *
+ * An entry in the level right above the last level may map an aligned block
+ * of NR_PTES_PER_PAGE page frames directly as a huge page. Such an entry has
+ * @huge set, and its @pfn is the first page frame of the block.
+ *
+ * A page evicted to the swap device leaves its PTE invalid but @swapped,
+ * with @pfn holding the swap slot of the page. All the PTEs sharing a page
+ * are swapped out and in together, so they keep sharing the same frame or
+ * the same slot.
+ *
+ * With the lazy allocation, an allocated page has its PTE invalid but @lazy
+ * until the first access assigns a page frame to it.
+ *
+ * MMU sets @accessed of the PTE on each access to the page, and @dirty on
+ * each write to it, whether the access hits TLB or walks the page table. A
+ * huge page has its bits in its huge page entry. @accessed is cleared when
+ * the working sets are sampled, and both are cleared when the page is
+ * unmapped, or is swapped out or in.
+ *
+ * The flags and the protection bits are packed into one word in front of
+ * the frame number or the directory pointer, so that a PTE takes 16 bytes
+ * and a cache line holds four of them.
  */
+struct pte_directory;
+
 struct pte {
-	bool valid;
-	unsigned int rw;
-	unsigned int pfn;
-	unsigned int private;	/* May use to backup something ;-) */
+	bool valid : 1;
+	bool huge : 1;
+	bool swapped : 1;
+	bool lazy : 1;
+	bool accessed : 1;
+	bool dirty : 1;
+	unsigned int rw : 2;
+	unsigned int private : 2;	/* May use to backup something ;-) */
+	union {
+		unsigned int pfn;		/* Last level; page frame number */
+		struct pte_directory *dir;	/* Upper levels; next-level directory */
+	};
 };
 
 struct pte_directory {
-	struct pte ptes[NR_PTES_PER_PAGE];
+	unsigned int refcount;	/* The number of entries pointing to this */
+	unsigned int nr_valid;	/* The number of valid entries */
+	struct pte ptes[];
 };
 
 struct pagetable {
-	struct pte_directory *outer_ptes[NR_PTES_PER_PAGE];
+	struct pte root;
+};
+
+/* Check whether @pte is not used at all */
+static inline bool pte_none(const struct pte *pte)
+{
+	return !pte->valid && !pte->swapped && !pte->lazy;
+}
+
+
+/**
+ * Reverse mapping from a page to a PTE that maps it. The reverse mappings of
+ * a page are chained in the list of its page frame, or of its swap slot
+ * while it is swapped out. A huge page is reverse-mapped only from its
+ * first page frame.
+ */
+struct rmap {
+	struct list_head list;
+	struct pte *pte;
+};
+
+
+/**
+ * Page frame descriptor for the page replacement. MMU stamps the frame with
+ * the time of the last access, and sets @referenced on every access.
+ */
+struct frame {
+	unsigned long seq;		/* When the page is brought in. For FIFO */
+	unsigned long stamp;		/* Last access. For LRU and working set */
+	bool referenced;		/* Reference bit for CLOCK */
+	unsigned int nr_huge_maps;	/* Huge pages mapping this. Never evicted */
+	struct list_head rmap;		/* PTEs mapping this frame */
+};
+
+
+/**
+ * The page frames are split into memory nodes of the same size, up to
+ * MAX_NR_NODES, and each node has its own buddy allocator. The CPUs are
+ * spread over the nodes in order.
+ */
+#define MAX_NR_NODES	8
+
+/**
+ * Policies to choose the node to allocate page frames from. LOCAL takes the
+ * node of the CPU that allocates, INTERLEAVE goes round the nodes, and
+ * PREFERRED takes the preferred node of the process. The other nodes are
+ * tried in order when the chosen node is full.
+ */
+enum mem_policy {
+	MEM_POLICY_LOCAL = 0,
+	MEM_POLICY_INTERLEAVE,
+	MEM_POLICY_PREFERRED,
+	NR_MEM_POLICIES,
+};
+
+
+/**
+ * Events that the timing model charges cycles for. WALK is charged for
+ * each directory read in a page walk, and SWITCH for each context switch.
+ * TLB_FLUSH is charged only when the TLBs are flushed as the ASIDs run out,
+ * since TLB entries are kept over context switches otherwise.
+ */
+enum cost_event {
+	COST_TLB_HIT = 0,
+	COST_WALK,
+	COST_FAULT,		/* Entering the page fault handler */
+	COST_COW,		/* Copying a page frame for copy-on-write */
+	COST_DIRECTORY,		/* Allocating a page directory */
+	COST_SWITCH,
+	COST_TLB_FLUSH,
+	COST_MIGRATE,		/* Migrating a page to compact the frames */
+	NR_COST_EVENTS,
 };
 
 
@@ -54,19 +186,545 @@ struct pagetable {
 struct process {
 	unsigned int pid;
 
+	unsigned int asid;		/* Address space ID to tag TLB entries */
+	unsigned long asid_generation;	/* Generation that @asid is assigned in */
+
 	struct pagetable pagetable;
 
+	/**
+	 * The parent whose page table this process borrows after vfork, or
+	 * NULL. @pagetable has the root entry of the parent while borrowing,
+	 * without a reference to the directory. @nr_borrowers counts the
+	 * children borrowing from this process.
+	 */
+	struct process *lender;
+	unsigned int nr_borrowers;
+
+	unsigned long nr_tlb_hits;	/* TLB lookups of this process */
+	unsigned long nr_tlb_misses;
+
+	/**
+	 * Working set size, which is the number of pages of this process
+	 * accessed in the last sampling interval, and the largest and the sum
+	 * of the sizes sampled since the process is created.
+	 */
+	unsigned int wss;
+	unsigned int max_wss;
+	unsigned long wss_sum;
+	unsigned long nr_wss_samples;
+
+	/**
+	 * Memory policy to allocate page frames for this process with.
+	 * @preferred_node is for PREFERRED, and @next_node is the node that
+	 * INTERLEAVE allocates from next. Memory accesses of this process are
+	 * local when the frame is in the node of the CPU, and remote otherwise.
+	 */
+	enum mem_policy mem_policy;
+	unsigned int preferred_node;
+	unsigned int next_node;
+	unsigned long nr_local_accesses;
+	unsigned long nr_remote_accesses;
+
+	/**
+	 * Cycles charged to this process by the timing model for each event,
+	 * and the memory accesses of this process with the cycles spent in
+	 * them, which give the average memory access time.
+	 */
+	unsigned long cycles[NR_COST_EVENTS];
+	unsigned long nr_accesses;
+	unsigned long access_cycles;
+
+	/**
+	 * CPUs that have run this process since the last TLB flush, so their
+	 * TLBs may cache the mappings of this process.
+	 */
+	unsigned long cpumask;
+
 	struct list_head list;  /* List head to chain processes on the system */
+	struct hlist_node hash;	/* Chained in the pid hash while in the list */
 };
 
+/* The processes in the ready queue are also hashed by their pids */
+#define PID_HASH_BITS	12
+#define NR_PID_HASH	(1U << PID_HASH_BITS)
 
+static inline unsigned int pid_hashfn(unsigned int pid)
+{
+	return (pid * 0x9e370001U) >> (32 - PID_HASH_BITS);
+}
+
+
+/**
+ * TLB entry. @valid, @huge, @asid, and @vpn are also kept in the tag of the
+ * entry in @cpu->tlb_tags, which is what lookups compare. Update them
+ * through the helpers in pa3.c to keep the tag in sync.
+ */
 struct tlb_entry {
 	bool valid;
+	bool huge;	/* Caches a huge page. @vpn and @pfn are for the first page */
 	int rw;
+	unsigned int asid;
 	unsigned int vpn;
 	unsigned int pfn;
 	unsigned int private;
+	unsigned long seq;	/* Insertion order to print entries in FIFO order */
+	unsigned long stamp;	/* Last time the entry is used. For LRU */
+	bool referenced;	/* Reference bit for CLOCK */
+	bool prefetched;	/* Prefetched, and not used yet */
+};
+
+#define NR_TLB_ENTRIES	256
+
+/* Flags in the tags of TLB entries above the ASID and the VPN */
+#define TLB_TAG_VALID	(1ULL << 63)
+#define TLB_TAG_HUGE	(1ULL << 62)
+
+/**
+ * tlb_tag(@asid, @vpn, @huge)
+ *
+ * DESCRIPTION
+ *   Return the tag of the valid TLB entry caching @vpn of @asid, or the huge
+ *   page from @vpn with @huge. Invalid entries have the tag 0, which never
+ *   matches the tag of a valid one.
+ */
+
+static inline uint64_t tlb_tag(unsigned int asid, unsigned int vpn, bool huge)
+{
+	return TLB_TAG_VALID | (huge ? TLB_TAG_HUGE : 0) | (uint64_t)asid << 32 | vpn;
+}
+
+/* The tag of @t as it is */
+static inline uint64_t tlb_entry_tag(const struct tlb_entry *t)
+{
+	return t->valid ? tlb_tag(t->asid, t->vpn, t->huge) : 0;
+}
+
+/* The number of address space IDs that TLB entries can be tagged with */
+#define NR_ASIDS	256
+
+/* The number of CPUs that can be simulated, up to the bits in cpumasks */
+#define MAX_NR_CPUS	64
+
+/**
+ * Entry of the page-walk cache. Caches the last-level directory of the VPNs
+ * whose bits above the last level are @tag, and the permission granted by
+ * the directories on the way to it.
+ */
+struct pwc_entry {
+	bool valid;
+	unsigned int tag;
+	struct pte_directory *dir;
+	unsigned int rw;
+	unsigned long stamp;	/* Last time the entry is used. For LRU */
+};
+
+#define NR_PWC_ENTRIES	64
+
+/**
+ * Simulated CPU. Each CPU runs its own current process with its own TLB.
+ * A CPU is idle with @curr NULL until a process is switched in.
+ */
+struct cpu {
+	unsigned int id;
+	unsigned int node;		/* Memory node this CPU belongs to */
+	struct process *curr;
+	struct pagetable *pt_base;	/* Page table base register */
+	struct tlb_entry tlb_entries[NR_TLB_ENTRIES];
+	uint64_t tlb_tags[NR_TLB_ENTRIES];	/* Tags of @tlb_entries */
+	unsigned int tlb_hands[NR_TLB_ENTRIES];	/* For the CLOCK policy */
+	struct pwc_entry pwc_entries[NR_PWC_ENTRIES];
+
+	/**
+	 * The last VPN accessed on this CPU, and its distance from the one
+	 * before. @prefetch_stride is the distance if it repeats, or 0.
+	 */
+	unsigned int last_vpn;
+	int last_stride;
+	int prefetch_stride;
+};
+
+/**
+ * Policies to choose the victim TLB entry when a TLB set is full
+ */
+enum tlb_policy {
+	TLB_POLICY_FIFO = 0,
+	TLB_POLICY_LRU,
+	TLB_POLICY_RANDOM,
+	TLB_POLICY_CLOCK,
+	NR_TLB_POLICIES,
 };
 
-#define NR_TLB_ENTRIES	(1 << (PTES_PER_PAGE_SHIFT * 2))
+/**
+ * Policies to prefetch translations into TLB on a TLB miss. NEXT prefetches
+ * the VPNs following the missed one. STRIDE prefetches the VPNs along the
+ * distance between the last accesses when the same distance repeats.
+ */
+enum tlb_prefetch {
+	TLB_PREFETCH_NONE = 0,
+	TLB_PREFETCH_NEXT,
+	TLB_PREFETCH_STRIDE,
+	NR_TLB_PREFETCHES,
+};
+
+/**
+ * Policies to choose the victim page to evict to the swap device when page
+ * frames run out
+ */
+enum page_policy {
+	PAGE_POLICY_FIFO = 0,
+	PAGE_POLICY_CLOCK,	/* Second chance with the reference bits */
+	PAGE_POLICY_LRU,
+	PAGE_POLICY_WS,		/* Pages out of the working set window first */
+	NR_PAGE_POLICIES,
+};
+
+/**
+ * How to print the results of operations
+ */
+enum output_mode {
+	OUTPUT_TEXT = 0,	/* Print each result as it comes out */
+	OUTPUT_BUFFERED,	/* Print each result through a large buffer */
+	OUTPUT_SUMMARY,		/* Print the counts of results at the end */
+	OUTPUT_NONE,		/* Print nothing but errors */
+	NR_OUTPUT_MODES,
+};
+
+/**
+ * Simulator configuration. Set up from the command line options before
+ * starting the simulation, and remains unchanged afterward.
+ */
+struct vm_config {
+	/**
+	 * TLB is organized as @tlb_sets sets of @tlb_ways entries each, and
+	 * a VPN is cached only in the set indexed by its VPN bits. @tlb_sets
+	 * should be a power of 2, and @tlb_sets * @tlb_ways should not exceed
+	 * NR_TLB_ENTRIES.
+	 */
+	unsigned int tlb_sets;
+	unsigned int tlb_ways;
+	enum tlb_policy tlb_policy;
+
+	/**
+	 * TLB misses look up the page-walk cache of @nr_pwc_entries entries, up
+	 * to NR_PWC_ENTRIES, before walking the page table from the root. The
+	 * cache is fully associative with LRU replacement, and is not used when
+	 * @nr_pwc_entries is 0.
+	 */
+	unsigned int nr_pwc_entries;
+
+	/**
+	 * Prefetch up to @prefetch_degree translations on a TLB miss according
+	 * to @tlb_prefetch. Only the VPNs mapped in the same last-level
+	 * directory as the missed one are prefetched.
+	 */
+	enum tlb_prefetch tlb_prefetch;
+	unsigned int prefetch_degree;
+
+	/**
+	 * The number of ASIDs to assign to processes, up to NR_ASIDS. When
+	 * they run out, the TLB is flushed and ASIDs are assigned again.
+	 */
+	unsigned int nr_asids;
+
+	/**
+	 * Geometry of the system. @nr_pt_levels * @ptes_per_page_shift bits
+	 * of VPN are translated through the page table, and should not exceed
+	 * the width of VPNs.
+	 */
+	unsigned int nr_pageframes;
+	unsigned int nr_pt_levels;
+	unsigned int ptes_per_page_shift;
+
+	/* The number of CPUs, up to MAX_NR_CPUS */
+	unsigned int nr_cpus;
+
+	/**
+	 * The number of memory nodes, up to MAX_NR_NODES, and the memory policy
+	 * of the processes made on idle CPUs. Others take after their parents.
+	 * PREFERRED prefers node 0 unless the process chooses its node.
+	 */
+	unsigned int nr_nodes;
+	enum mem_policy mem_policy;
+
+	/**
+	 * Swap device of @nr_swap_slots pages. Pages are evicted to the device
+	 * according to @page_policy when page frames run out, and the device is
+	 * not used when @nr_swap_slots is 0. The working set of the WS policy
+	 * is the pages accessed in the last @ws_window memory accesses.
+	 */
+	unsigned int nr_swap_slots;
+	enum page_policy page_policy;
+	unsigned int ws_window;
+
+	/**
+	 * Allocate pages lazily. 'alloc' only reserves the page, and a page
+	 * frame is assigned on the first write to it. Reads before that map the
+	 * zero frame shared by all such pages.
+	 */
+	bool lazy_alloc;
+
+	/**
+	 * Sample the working set sizes of the processes every @wss_interval
+	 * memory accesses, or never if 0.
+	 */
+	unsigned int wss_interval;
+
+	/**
+	 * Compact the page frames every @compact_interval memory accesses in
+	 * the background, or never if 0.
+	 */
+	unsigned int compact_interval;
+
+	/* Cycles that the timing model charges for each event */
+	unsigned int costs[NR_COST_EVENTS];
+
+	enum output_mode output_mode;
+};
+
+/**
+ * Event counters of the system. Shown by the 'stats' command, and dumped
+ * in JSON at exit with the -j option.
+ */
+struct vm_stats {
+	unsigned long tlb_hits;
+	unsigned long tlb_misses;
+
+	/**
+	 * TLB prefetches, and how they end up. A prefetch is useful when the
+	 * entry is hit, and wasted when the entry is evicted before that.
+	 */
+	unsigned long tlb_prefetches;
+	unsigned long prefetch_useful;
+	unsigned long prefetch_wasted;
+
+	/* Page-walk cache lookups on TLB misses */
+	unsigned long pwc_hits;
+	unsigned long pwc_misses;
+
+	/**
+	 * Page walks by the number of directories they read. A walk stops
+	 * early at an invalid entry or a huge page, and reads only the
+	 * last-level directory when the page-walk cache has it.
+	 */
+	unsigned long walk_depths[MAX_NR_PT_LEVELS + 1];
+
+	/* Page faults by their causes */
+	unsigned long faults_no_directory;
+	unsigned long faults_invalid_pte;
+	unsigned long faults_write_protect;
+
+	/* How write-protect faults are resolved */
+	unsigned long cow_copies;	/* Copy the shared page */
+	unsigned long write_enables;	/* Make the page writable again */
+	unsigned long huge_splits;	/* Split the shared huge page */
+
+	unsigned long directory_allocs;
+	unsigned long directory_frees;
+	unsigned long directory_copies;	/* Copy the shared directories */
+
+	unsigned long forks;
+	unsigned long spawns;		/* Processes made with empty address spaces */
+	unsigned long vforks;
+	unsigned long vfork_breaks;	/* vfork children stopped borrowing */
+	unsigned long exits;
+	unsigned long switches;
+
+	/**
+	 * TLB shootdowns. The invalidations for the TLBs of other CPUs are
+	 * batched during an operation, and sent together at its end as one
+	 * shootdown with an IPI to each target CPU.
+	 */
+	unsigned long tlb_shootdowns;
+	unsigned long tlb_shootdown_ipis;
+	unsigned long tlb_shootdown_entries;	/* Invalidations requested */
+
+	/**
+	 * Major faults read the page from the swap device, whereas minor faults
+	 * are resolved without I/O. Swap I/O is counted in pages.
+	 */
+	unsigned long major_faults;
+	unsigned long minor_faults;
+	unsigned long swap_outs;
+	unsigned long swap_ins;
+
+	/* Demand-zero faults that assign a frame, or map the zero frame */
+	unsigned long zero_fills;
+	unsigned long zero_maps;
+
+	/* The largest number of page frames in use at the end of operations */
+	unsigned long peak_frames;
+
+	/**
+	 * Working set samples taken, and the largest sum of the working set
+	 * sizes of the processes in a sample
+	 */
+	unsigned long wss_samples;
+	unsigned long peak_wss;
+
+	/**
+	 * Memory accesses to the frames in the node of the CPU, and in the
+	 * other nodes. Allocations that the chosen node cannot satisfy fall
+	 * back to the other nodes.
+	 */
+	unsigned long local_accesses;
+	unsigned long remote_accesses;
+	unsigned long node_fallbacks;
+
+	/**
+	 * Cycles charged by the timing model in total, and the memory accesses
+	 * with the cycles spent in them
+	 */
+	unsigned long cycles;
+	unsigned long memory_accesses;
+	unsigned long access_cycles;
+
+	/* Compaction passes over the page frames, and the pages they migrate */
+	unsigned long compactions;
+	unsigned long compact_migrations;
+};
+
+/**
+ * A simulated system. Everything a simulation changes lives in here, so
+ * that systems of different configurations can be simulated in parallel on
+ * threads, each of which simulates its own instance through @vm.
+ */
+struct vm_instance {
+	struct vm_config config;
+	struct vm_stats stats;
+
+	/**
+	 * CPUs of the system. @init runs on CPU 0, and the other CPUs are idle
+	 * at the beginning. The current process of a CPU is not in @processes.
+	 */
+	struct process init;
+	struct cpu cpus[MAX_NR_CPUS];
+	struct cpu *this_cpu;
+
+	/**
+	 * Ready queue, and the hash table of the processes in it to find them
+	 * by their pids. Put @current process to the tail of the queue on
+	 * switch_process(), and remove the switched process from the queue. A
+	 * process is hashed when it is put into @processes, and unhashed when
+	 * it is removed from the list.
+	 */
+	struct list_head processes;
+	struct hlist_head pid_hash[NR_PID_HASH];
+
+	/**
+	 * Map count and descriptor for each page frame. Allocated for
+	 * @config.nr_pageframes. @frame_clock ticks on each memory access to
+	 * stamp the frames.
+	 */
+	unsigned int *mapcounts;
+	struct frame *frames;
+	unsigned long frame_clock;
+
+	/* Page frame filled with zeros for the lazy allocation, or -1 if none */
+	unsigned int zero_pfn;
+
+	struct buddy_zone frame_zones[MAX_NR_NODES];	/* For each node */
+	struct pool directory_pool;
+	struct pool process_pool;
+	struct pool rmap_pool;
+
+	/* The number of operations simulated and failed for each opcode */
+	struct {
+		unsigned long nr_ops;
+		unsigned long nr_failed;
+	} summary[NR_OPCODES];
+
+	/* State of the TLBs and ASIDs, which is private to pa3.c */
+	struct {
+		unsigned long tlb_seq;		/* To stamp the insertion order */
+		unsigned long tlb_clock;	/* To stamp the last use for LRU */
+		unsigned int tlb_random;	/* For the RANDOM policy */
+		unsigned long pwc_clock;	/* To stamp page-walk cache entries */
+
+		unsigned long asid_generation;
+		unsigned int next_asid;
+
+		/* Shootdowns to send at the end of the current operation */
+		struct {
+			unsigned long cpumask;
+			unsigned int nr_entries;
+		} tlb_batch;
+
+		unsigned int nr_huge_mappings;
+	} mmu;
+
+	/* State of the swap device and the page replacement, private to pa3.c */
+	struct {
+		unsigned long *slot_map;	/* Slots in use */
+		unsigned int *slot_counts;	/* PTEs referring to each slot */
+		struct list_head *slot_rmaps;	/* and the PTEs themselves */
+		unsigned long seq;		/* To stamp the frames brought in */
+		unsigned int hand;		/* For CLOCK and WS */
+	} swap;
+};
+
+/**
+ * The instance that the calling thread simulates. The state of the system
+ * is always reached through it, like @vm->config, and the current process
+ * and the page table of the CPU running the operation are those of
+ * @vm->this_cpu.
+ */
+extern __thread struct vm_instance *vm;
+
+/**
+ * report(@fmt, ...)
+ *
+ * DESCRIPTION
+ *   Print the result of an operation unless the results are summarized.
+ *   The notices of the operations go along with the results, so that they
+ *   keep their order in the buffered output as well.
+ */
+void report(const char *fmt, ...);
+
+/**
+ * pt_index(@vpn, @level)
+ *
+ * DESCRIPTION
+ *   Return the index of the entry for @vpn in the directory of @level. The
+ *   top-level directory is level 0.
+ */
+static inline unsigned int pt_index(unsigned int vpn, unsigned int level)
+{
+	unsigned int shift = (vm->config.nr_pt_levels - 1 - level) * PTES_PER_PAGE_SHIFT;
+
+	return (vpn >> shift) & (NR_PTES_PER_PAGE - 1);
+}
+
+/**
+ * charge_cycles(@event, @nr)
+ *
+ * DESCRIPTION
+ *   Charge the cycles for @nr times of @event to the system, and to the
+ *   current process of this CPU if any.
+ */
+static inline void charge_cycles(enum cost_event event, unsigned int nr)
+{
+	unsigned long cycles = (unsigned long)vm->config.costs[event] * nr;
+	struct process *current = vm->this_cpu->curr;
+
+	vm->stats.cycles += cycles;
+	if (current) current->cycles[event] += cycles;
+}
+
+/**
+ * frame_node(@pfn)
+ *
+ * DESCRIPTION
+ *   Return the memory node that the page frame @pfn belongs to. Each node
+ *   has @config.nr_pageframes / @config.nr_nodes frames from node 0, and the
+ *   last node takes the rest as well.
+ */
+static inline unsigned int frame_node(unsigned int pfn)
+{
+	unsigned int node;
+
+	if (vm->config.nr_nodes == 1) return 0;
+
+	node = pfn / (vm->config.nr_pageframes / vm->config.nr_nodes);
+	return node < vm->config.nr_nodes ? node : vm->config.nr_nodes - 1;
+}
 #endif